@@ -29,19 +29,96 @@
 #include <ZL_Input.h>
 #include <ZL_SynthImc.h>
 #include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <chrono>
+#include <atomic>
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
-enum
+//Occupancy bit mask of one row in the well, only specialized for the supported well widths
+template <int Width> struct WellMaskType;
+template <> struct WellMaskType<10> { typedef unsigned short Type; };
+template <> struct WellMaskType<16> { typedef unsigned short Type; };
+template <> struct WellMaskType<32> { typedef unsigned int Type; };
+template <> struct WellMaskType<64> { typedef unsigned long long Type; };
+static const int well_widths[] = { 10, 16, 32, 64 };
+#define WELL_MAX_WIDTH 64
+
+//Landed blocks are stored as a grid of rows holding the occupancy mask and the tile of each cell
+//The grid and everything stepping or drawing it is instantiated for each well width, the width of a run is picked on the title screen
+template <int Width> struct Well
 {
-	VIEW_HEIGHT = 20,
-	VIEW_HALF = 10,
-	WELL_WIDTH = 10,
-	WELL_HALF = 5,
+	typedef typename WellMaskType<Width>::Type Mask;
+	struct Row
+	{
+		Mask used;
+		unsigned char shape[Width], color[Width];
+		unsigned int serial; //changes whenever a cell of the row is set
+	};
+	static std::vector<Row> rows;
+	static int tops[Width];
+	static Mask Bit(int x) { return (Mask)1 << x; }
 };
+template <int Width> std::vector<typename Well<Width>::Row> Well<Width>::rows;
+template <int Width> int Well<Width>::tops[Width];
+#define WELL_DISPATCH(func, ...) (well_width == 64 ? func<64>(__VA_ARGS__) : (well_width == 32 ? func<32>(__VA_ARGS__) : (well_width == 16 ? func<16>(__VA_ARGS__) : func<10>(__VA_ARGS__))))
+
 #define PLAYER_WIDTH .3f
 #define PLAYER_HEIGHT .45f
 #define PLAYER_SCALE .03f
-#define TOMTPF (1.f/60.f)
+#define PLAYER_MAX_STEP .1f
+#ifndef TOMTICKRATE
+#define TOMTICKRATE 60
+#endif
+#define TOMTPF (1.f/(float)TOMTICKRATE)
 #define TOMELAPSEDF(factor) (TOMTPF*(s(factor)))
+#define TOMELAPSED60(factor) (s(factor)/60.f)
+#define TOMTICKS ((ticks_t)((unsigned long long)sim_steps * 1000 / TOMTICKRATE))
+#define TOMSINCE(t) (TOMTICKS - (t))
+#define DOWNPOUR_PIECES 4
+#define PIECE_MAX_BLOCKS (WELL_MAX_WIDTH*8)
+#define WELL_RESERVE_ROWS 4096
+#define WELL_RESERVE_AHEAD 256
+#define SPECTATOR_RESERVE_AHEAD 65536
+#define SPECTATOR_MAX_PENDING 32768
+#define INPUT_QUEUE_SIZE 64
+#define JUMP_QUEUE_SIZE 8
+#define JUMP_COYOTE_MS 120
+#define JUMP_BUFFER_MS 100
+#define PIECE_QUEUE_SIZE 3
+#define PREVIEW_CELL 16
+#define LOD_ROW_PIXELS 2
+#define LOD_LEVELS 3
+#define LOD_LEVEL_SHIFT 4
+#define FRAMEDUMP_WIDTH 1280
+#define FRAMEDUMP_HEIGHT 720
+#define FRAMEDUMP_DEFAULT_FRAMES 100
+#define FRAMEDUMP_INTERVAL TOMTICKRATE
+#define FRAMEDUMP_TOLERANCE 2
+#define SNAPSHOT_RESERVE_ROWS 1024
+#define TILEMAP_WIDTH 256
+#define TILEMAP_RING 1024
+#define TILEMAP_RING_X 128
+#define TILEMAP_TILE 64
+#define SIM_MAX_BEHIND_MS 250
 
 /*
 static ZL_Color falling_colors[] =
@@ -91,6 +168,13 @@ static ZL_Color falling_colors[] =
 	landed_colors[7]*1.2f,
 };
 
+static const ZL_Color colOutGradientTop    = ZLRGB( 0, 0,.4);
+static const ZL_Color colOutGradientBottom = ZLRGB(.4,.4,.8);
+static const ZL_Color colInGradientTop     = ZLRGB( 0, 0,.2);
+static const ZL_Color colInGradientBottom  = ZLRGB(.2,.2,.4);
+static const ZL_Color colStripes           = ZLRGB(.5,.7,.9);
+static const ZL_Color colShadow            = ZLLUMA(0, .6);
+
 struct Block
 {
 	int x, prevy;
@@ -99,32 +183,223 @@ struct Block
 	Block(int x, float y, int shape, int color) : x(x), y(y), prevy((int)y), shape(shape), color(color) {}
 };
 
+struct Piece
+{
+	std::vector<Block> blocks;
+	float vel, step, low;
+	int id, spectate_y;
+};
+
 struct Player
 {
 	float x, y;
 	float velx, vely;
 	bool dead, stand_landed, stand_falling;
-	int jump, jumps;
+	int stand_piece, jump, jumps;
 	ticks_t standTicks;
 };
 
-static bool titleScreen = true;
-static std::vector<Block> falling, landed;
+static bool titleScreen = true, downpour;
+static std::vector<Piece> falling;
+static std::vector<std::vector<Block> > block_pool;
+
+struct QueuedPiece
+{
+	int count, shape, color;
+	int left, right, bottom, top;
+	short x[PIECE_MAX_BLOCKS], y[PIECE_MAX_BLOCKS];
+};
+static QueuedPiece piece_queue[PIECE_QUEUE_SIZE];
+static int piece_queue_start, piece_queue_count;
+static int piece_counter;
 static Player player;
 static int score_y;
-static float scroll_y = VIEW_HALF;
-static float fall_vel;
+static float scroll_y;
 static ZL_Surface srfBG, srfBlocks, srfPlayer, srfStripes, srfLudumDare;
-static int well_tops[WELL_WIDTH];
+static unsigned int cell_serial;
+
+//Landed blocks and their shadows are drawn as one quad by a fragment shader looking up the cell under each pixel in srfTilemap
+//The texture holds a copy of the block tiles, the landed colors and a ring of TILEMAP_RING rows with the shape and color of each cell
+//A row is only written again when a different row scrolled into its slot or one of its cells was set since
+static ZL_Surface srfTilemap;
+static ZL_Shader shdTilemap;
+static int tilemap_rows[TILEMAP_RING];
+static unsigned int tilemap_serials[TILEMAP_RING];
+static int well_width, well_height, view_half;
+
+//Color sums of the landed cells in each row and in chunks of 16 and 256 rows, drawn instead of single blocks once a row is only a few pixels tall
+//All levels are updated as cells land so drawing sums at most 16 entries of the coarsest level that fits into one merged rectangle
+struct RowSummary
+{
+	int cells;
+	float r, g, b;
+};
+static std::vector<RowSummary> row_summaries[LOD_LEVELS];
+static float overview;
+static int hud_tier = -1; //jump upgrade shown in the HUD, set once the player first climbs
 static ticks_t failTicks;
 static ZL_Font fntMain;
 static ZL_TextBuffer txtGameOver, txtTitle;
-static ZL_TextBuffer txt[6];
+static ZL_TextBuffer txt[3];
+static ZL_TextBuffer txtJumps[3], txtJumpsNext[3], txtJumpsAt[3], txtRestartEsc, txtRestartSpace, txtNext, txtDigits[10];
+static float digit_width[10];
+#ifdef ZILLALOG
+static ZL_TextBuffer txtDebug[3];
+static float debug_width[3];
+#endif
 static ticks_t startTicks;
 static ticks_t upgradeTicks;
 static ticks_t deadTicks;
+
+//Gameplay timers run on the simulation clock (TOMTICKS) and pieces come from their own seeded generator so a run only depends on its seed and input
+static unsigned int sim_steps, seed, rand_state;
+static bool autoplay;
+static int autoplay_dir = 1;
 static float shake = 0;
 
+//State of the previous simulation step, Draw interpolates from it by the fraction of the next step already elapsed
+struct StepSnapshot
+{
+	float player_x, player_y, scroll_y;
+};
+static StepSnapshot prev_step;
+
+//Key events are queued by the main thread with the wall clock time they arrived at and taken by the first simulation step standing for that time or later
+//A step sees which keys are held and which went down since the last step, jump presses also wait in their own queue for up to JUMP_BUFFER_MS until the player can jump
+struct InputEvent
+{
+	double ms;
+	int key;
+	bool down;
+};
+static const int input_keys[] = { ZLK_SPACE, ZLK_A, ZLK_LEFT, ZLK_D, ZLK_RIGHT, ZLK_Z, ZLK_ESCAPE, ZLK_W, ZLK_X, ZLK_L };
+enum { KEY_SPACE = 1, KEY_A = 2, KEY_LEFT = 4, KEY_D = 8, KEY_RIGHT = 16, KEY_Z = 32, KEY_ESCAPE = 64, KEY_W = 128, KEY_X = 256, KEY_L = 512 };
+static InputEvent input_queue[INPUT_QUEUE_SIZE];
+static std::atomic<unsigned int> input_head, input_tail; //head only written by the main thread, tail only by the simulation
+static int input_held, input_pressed, keys_down;
+static double jump_queue[JUMP_QUEUE_SIZE];
+static int jump_queue_start, jump_queue_count;
+static double step_ms; //wall clock time the current simulation step stands for
+static float input_latency; //wall clock ms from the arrival of the last jump press to the step that took it
+
+//Everything Draw needs is published by the simulation after its steps into one of three snapshots, each frame draws the latest one
+//On desktop the simulation runs on its own thread at TOMTICKRATE, the web build steps it between frames on the main thread
+//Sounds, the music volume and quitting are requested through the snapshot and done by the main thread
+enum { SOUND_JUMP, SOUND_DEATH, SOUND_FALL, SOUND_LAND, SOUND_LVLUP, SOUND_COUNT };
+struct SnapshotRow
+{
+	unsigned long long used;
+	unsigned char shape[WELL_MAX_WIDTH], color[WELL_MAX_WIDTH];
+	unsigned int serial;
+};
+struct SnapshotBlock
+{
+	float x, y, step;
+	int shape, color;
+};
+struct SnapshotRect
+{
+	float low, high;
+	ZL_Color color;
+};
+struct Snapshot
+{
+	double ms; //wall clock time the last step stands for
+	bool title, lod, quit;
+	int width, view_half, well_height, score, hud_tier;
+	Player player;
+	StepSnapshot prev;
+	float scroll_y, overview;
+	ticks_t since_start, since_upgrade, since_dead;
+	unsigned int landings, sounds[SOUND_COUNT];
+	int row_first;
+	std::vector<SnapshotRow> rows; //landed rows from row_first that can be in view, empty when zoomed out far enough to draw lod_rects instead
+	std::vector<SnapshotRect> lod_rects;
+	std::vector<SnapshotBlock> blocks; //of all falling pieces
+	bool has_next;
+	QueuedPiece next;
+	float input_latency;
+	unsigned int spectator_bytes;
+};
+#define SNAPSHOT_FRESH 4
+static Snapshot snapshots[3];
+static std::atomic<int> snapshot_ready(1); //index of the latest published snapshot, SNAPSHOT_FRESH is set until the main thread takes it
+static int snapshot_write = 0, snapshot_read = 2;
+static std::atomic<int> display_height; //the simulation picks the level of detail of the zoomed out tower with it
+static unsigned int sim_landings, sim_sounds[SOUND_COUNT];
+static bool sim_quit_request;
+#ifndef __EMSCRIPTEN__
+static std::thread sim_thread;
+static std::atomic<bool> sim_quit;
+#endif
+
+//Optional per-tick delta stream for external spectator viewers (enabled with '-spectate <fifo or file>')
+//The target is opened and written without blocking, a FIFO without reader or a viewer falling behind drops the stream until the next run starts
+//Every tick with changes starts with a TICK record followed by tagged records, all values little-endian
+//Positions are 24.8 fixed point, a tick costs at most 24 bytes plus 7 bytes per falling piece and 9 bytes plus 3 bytes per block for each spawned piece
+//tools/spectator_reader.cpp parses the stream and checks every tick against this bound
+enum
+{
+	SPECTATE_TICK   = 1, //u16 ticks since last tick record
+	SPECTATE_RESET  = 2, //u8 well width, i32 player x, i32 player y
+	SPECTATE_PLAYER = 3, //i16 delta x, i16 delta y
+	SPECTATE_SPAWN  = 4, //u16 piece id, u16 block count, i32 y of first block, per block: u8 x, i8 row offset to first block, u8 shape<<4|color
+	SPECTATE_FALL   = 5, //u16 piece id, i16 delta y of falling piece
+	SPECTATE_LAND   = 6, //u16 piece id, i32 landed row of first block of falling piece
+	SPECTATE_SCORE  = 7, //i32 score
+	SPECTATE_DEAD   = 8,
+};
+//Optional binary gameplay event log for analyzing runs (enabled with '-telemetry <file>')
+//Events are TelemetryEvent structs in native byte order, collected in a ring buffer and written out by a background thread (desktop only)
+enum
+{
+	TELEMETRY_RUN        = 1, //value: 1 in downpour mode, extra: well width
+	TELEMETRY_SPAWN      = 2, //value: shape retries, extra: placement retries
+	TELEMETRY_SPAWN_FAIL = 3,
+	TELEMETRY_LAND       = 4, //value: landed row, extra: collide height
+	TELEMETRY_JUMP       = 5, //value: jump number
+	TELEMETRY_LEVELUP    = 6, //value: score, extra: jumps
+	TELEMETRY_DEATH      = 7, //value: score, extra: cause
+	TELEMETRY_ABANDON    = 8, //value: score, run left with ESC or by closing the game
+	TELEMETRY_DROPPED    = 9, //value: number of events lost before this one because the ring buffer was full
+};
+enum { DEATH_CRUSHED, DEATH_FELL, DEATH_SPAWN_TIMEOUT };
+struct TelemetryEvent
+{
+	unsigned int ms; //time since run start
+	int value;
+	unsigned short extra;
+	unsigned char type, unused;
+};
+#define TELEMETRY_RING_SIZE 4096
+#define TELEMETRY_FLUSH_MS 50
+static FILE* telemetry;
+#ifndef __EMSCRIPTEN__
+static TelemetryEvent telemetry_ring[TELEMETRY_RING_SIZE];
+static std::atomic<unsigned int> telemetry_head, telemetry_tail; //head only written by the game, tail only by the flush thread
+static std::atomic<bool> telemetry_quit;
+static std::thread telemetry_thread;
+static unsigned int telemetry_dropped; //events lost since the last one that fit into the ring
+#endif
+
+//Optional headless rendering of the game into PPM images every second of simulation (enabled with '-framedump <path prefix>')
+//With '-framecompare <path prefix>' the images are compared against an earlier dump instead, ending at the first missing image
+//Both run before the display and audio are opened, the autoplay bot plays seeded pieces ('-seed <n>', default 1) as fast as possible
+//and Draw renders each image through the CPU canvas, '-frames <n>' ends after n images (default FRAMEDUMP_DEFAULT_FRAMES)
+//Images are written as PPM because there is no PNG encoder at hand, HUD text is left out because fonts are only rendered by the GPU
+enum { FRAMEDUMP_SIZE = FRAMEDUMP_WIDTH * FRAMEDUMP_HEIGHT * 3 };
+static const char* framedump;
+static bool framecompare;
+static unsigned int framedump_ticks, framedump_index, framedump_frames = FRAMEDUMP_DEFAULT_FRAMES, framedump_failures;
+static unsigned char framedump_image[FRAMEDUMP_SIZE], framedump_golden[FRAMEDUMP_SIZE];
+
+static const char* spectator_path;
+static int spectator = -1;
+static std::vector<unsigned char> spectator_buf;
+static int spectator_x, spectator_y, spectator_score, spectator_idle;
+static unsigned int spectator_bytes; //written in the current run
+static bool spectator_dead, spectator_ticked;
+
 extern ZL_SynthImcTrack imcJump;
 extern ZL_SynthImcTrack imcDeath;
 extern ZL_SynthImcTrack imcFall;
@@ -132,82 +407,420 @@ extern ZL_SynthImcTrack imcLand;
 extern ZL_SynthImcTrack imcLvlUp;
 extern ZL_SynthImcTrack imcMusic;
 
+#ifndef __EMSCRIPTEN__
+static void TelemetryPut(unsigned int index, unsigned char type, int value, int extra = 0)
+{
+	TelemetryEvent& e = telemetry_ring[index % TELEMETRY_RING_SIZE];
+	e.ms = TOMSINCE(startTicks);
+	e.value = value;
+	e.extra = (unsigned short)extra;
+	e.type = type;
+}
+
+//When the flush thread falls behind, new events are dropped and counted instead of overwriting ones not written yet
+static void Telemetry(unsigned char type, int value = 0, int extra = 0)
+{
+	if (!telemetry) return;
+	unsigned int head = telemetry_head.load(std::memory_order_relaxed);
+	if (head - telemetry_tail.load(std::memory_order_acquire) + (telemetry_dropped ? 2 : 1) > TELEMETRY_RING_SIZE) { telemetry_dropped++; return; }
+	if (telemetry_dropped) TelemetryPut(head++, TELEMETRY_DROPPED, (int)telemetry_dropped);
+	telemetry_dropped = 0;
+	TelemetryPut(head++, type, value, extra);
+	telemetry_head.store(head, std::memory_order_release);
+}
+
+static void TelemetryWrite()
+{
+	unsigned int tail = telemetry_tail.load(std::memory_order_relaxed), head = telemetry_head.load(std::memory_order_acquire);
+	if (tail == head) return;
+	while (tail != head)
+	{
+		unsigned int start = tail % TELEMETRY_RING_SIZE, count = MIN(head - tail, TELEMETRY_RING_SIZE - start);
+		fwrite(&telemetry_ring[start], sizeof(TelemetryEvent), count, telemetry);
+		tail += count;
+		telemetry_tail.store(tail, std::memory_order_release);
+	}
+	fflush(telemetry);
+}
+
+static void TelemetryThread()
+{
+	while (!telemetry_quit.load())
+	{
+		TelemetryWrite();
+		std::this_thread::sleep_for(std::chrono::milliseconds(TELEMETRY_FLUSH_MS));
+	}
+	TelemetryWrite();
+}
+
+//Events not written yet would be lost when the game is closed mid-run
+static void TelemetryQuit()
+{
+	telemetry_quit = true;
+	telemetry_thread.join();
+	if (!titleScreen && !player.dead) Telemetry(TELEMETRY_ABANDON, score_y);
+	else if (telemetry_dropped)
+	{
+		TelemetryPut(telemetry_head, TELEMETRY_DROPPED, (int)telemetry_dropped);
+		telemetry_head++;
+	}
+	TelemetryWrite();
+	fclose(telemetry);
+}
+#else
+static void Telemetry(unsigned char, int = 0, int = 0) { }
+#endif
+
+static int SpectatorFixed(float v) { return (int)(v * 256.f + (v < 0 ? -.5f : .5f)); }
+
+static void SpectatorPut(int v, int bytes)
+{
+	for (int i = 0; i != bytes; i++) spectator_buf.push_back((unsigned char)(v >> (i * 8)));
+}
+
+static void SpectatorRecord(int tag)
+{
+	if (!spectator_ticked)
+	{
+		spectator_buf.push_back(SPECTATE_TICK);
+		SpectatorPut(spectator_idle, 2);
+		spectator_idle = 0;
+		spectator_ticked = true;
+	}
+	spectator_buf.push_back((unsigned char)tag);
+}
+
+static void SpectatorClose()
+{
+	close(spectator);
+	spectator = -1;
+	spectator_buf.clear();
+	spectator_ticked = false;
+}
+
+static void SpectatorReset()
+{
+	if (spectator < 0 && spectator_path) spectator = open(spectator_path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_BINARY, 0644);
+	if (spectator < 0) return;
+	spectator_bytes = 0;
+	spectator_x = SpectatorFixed(player.x);
+	spectator_y = SpectatorFixed(player.y);
+	spectator_score = score_y;
+	spectator_dead = false;
+	SpectatorRecord(SPECTATE_RESET);
+	SpectatorPut(well_width, 1);
+	SpectatorPut(spectator_x, 4);
+	SpectatorPut(spectator_y, 4);
+}
+
+static void SpectatorSpawn(Piece& p)
+{
+	if (spectator < 0) return;
+	p.spectate_y = SpectatorFixed(p.blocks[0].y);
+	SpectatorRecord(SPECTATE_SPAWN);
+	SpectatorPut(p.id, 2);
+	SpectatorPut((int)p.blocks.size(), 2);
+	SpectatorPut(p.spectate_y, 4);
+	for (Block& b : p.blocks)
+	{
+		SpectatorPut(b.x, 1);
+		SpectatorPut(b.prevy - p.blocks[0].prevy, 1);
+		SpectatorPut((b.shape << 4) | b.color, 1);
+	}
+}
+
+static void SpectatorLand(const Piece& p)
+{
+	if (spectator < 0) return;
+	SpectatorRecord(SPECTATE_LAND);
+	SpectatorPut(p.id, 2);
+	SpectatorPut(p.blocks[0].prevy, 4);
+}
+
+static void SpectatorTick()
+{
+	if (spectator < 0) return;
+	int x = SpectatorFixed(player.x), y = SpectatorFixed(player.y);
+	if (x != spectator_x || y != spectator_y)
+	{
+		int dx = MAX(-32768, MIN(32767, x - spectator_x)), dy = MAX(-32768, MIN(32767, y - spectator_y));
+		SpectatorRecord(SPECTATE_PLAYER);
+		SpectatorPut(dx, 2);
+		SpectatorPut(dy, 2);
+		spectator_x += dx;
+		spectator_y += dy;
+	}
+	for (Piece& p : falling)
+	{
+		if (SpectatorFixed(p.blocks[0].y) == p.spectate_y) continue;
+		int dy = MAX(-32768, MIN(32767, SpectatorFixed(p.blocks[0].y) - p.spectate_y));
+		SpectatorRecord(SPECTATE_FALL);
+		SpectatorPut(p.id, 2);
+		SpectatorPut(dy, 2);
+		p.spectate_y += dy;
+	}
+	if (score_y != spectator_score)
+	{
+		SpectatorRecord(SPECTATE_SCORE);
+		SpectatorPut(score_y, 4);
+		spectator_score = score_y;
+	}
+	if (player.dead && !spectator_dead)
+	{
+		SpectatorRecord(SPECTATE_DEAD);
+		spectator_dead = true;
+	}
+	if (!spectator_ticked)
+	{
+		if (spectator_idle < 0xFFFF) spectator_idle++;
+		return;
+	}
+	spectator_ticked = false;
+	spectator_idle = 1;
+}
+
+//The ticks of a frame are written at once, what a slow viewer doesn't take yet stays buffered up to SPECTATOR_MAX_PENDING bytes
+static void SpectatorFlush()
+{
+	if (spectator < 0 || spectator_buf.empty()) return;
+	int written = (int)write(spectator, &spectator_buf[0], (unsigned int)spectator_buf.size());
+	if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) { SpectatorClose(); return; }
+	if (written > 0)
+	{
+		spectator_bytes += written;
+		spectator_buf.erase(spectator_buf.begin(), spectator_buf.begin() + written);
+	}
+	if (spectator_buf.size() > SPECTATOR_MAX_PENDING) SpectatorClose();
+}
+
+//Block storage of pieces is recycled through block_pool so spawning and landing don't allocate
+static Piece& AddPiece()
+{
+	falling.push_back(Piece());
+	std::vector<Block>& blocks = falling.back().blocks;
+	if (block_pool.size()) { blocks.swap(block_pool.back()); block_pool.pop_back(); }
+	else blocks.reserve(PIECE_MAX_BLOCKS);
+	blocks.clear();
+	return falling.back();
+}
+
+static void RemovePiece(size_t i)
+{
+	if (i != falling.size() - 1) std::swap(falling[i], falling.back());
+	block_pool.push_back(std::vector<Block>());
+	block_pool.back().swap(falling.back().blocks);
+	falling.pop_back();
+}
+
+template <int Width> static void AddLandedCell(int x, int y, int shape, int color)
+{
+	std::vector<typename Well<Width>::Row>& rows = Well<Width>::rows;
+	if (y >= (int)rows.size()) rows.resize(y + 1, typename Well<Width>::Row());
+	typename Well<Width>::Row& row = rows[y];
+	row.used |= Well<Width>::Bit(x);
+	row.shape[x] = (unsigned char)shape;
+	row.color[x] = (unsigned char)color;
+	row.serial = ++cell_serial;
+	well_height = (int)rows.size();
+
+	for (int level = 0; level != LOD_LEVELS; level++)
+	{
+		std::vector<RowSummary>& summaries = row_summaries[level];
+		int index = y >> (LOD_LEVEL_SHIFT * level);
+		if (index >= (int)summaries.size()) summaries.resize(index + 1, RowSummary());
+		RowSummary& summary = summaries[index];
+		summary.cells++;
+		summary.r += landed_colors[color].r;
+		summary.g += landed_colors[color].g;
+		summary.b += landed_colors[color].b;
+	}
+}
+
+template <int Width> static void InitWell()
+{
+	Well<Width>::rows.reserve(WELL_RESERVE_ROWS);
+	Well<Width>::rows.clear();
+	for (int i = 0; i != Width; i++)
+	{
+		AddLandedCell<Width>(i, 0, 0, 0);
+		Well<Width>::tops[i] = 1;
+	}
+}
+
+//Storage growing with the tower is extended before each step ahead of use so ticks never reallocate it
+template <int Width> static void WellReserve()
+{
+	std::vector<typename Well<Width>::Row>& rows = Well<Width>::rows;
+	if (rows.capacity() < rows.size() + WELL_RESERVE_AHEAD) rows.reserve(MAX(rows.capacity() * 2, rows.size() + WELL_RESERVE_AHEAD));
+	for (std::vector<RowSummary>& summaries : row_summaries)
+		if (summaries.capacity() < summaries.size() + WELL_RESERVE_AHEAD) summaries.reserve(MAX(summaries.capacity() * 2, summaries.size() + WELL_RESERVE_AHEAD));
+}
+
+static void SetWellWidth(int width)
+{
+	well_width = width;
+	view_half = (width > 20 ? width / 2 : 10);
+	scroll_y = (float)view_half;
+}
+
+static double WallMs()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void PlaySound(int sound)
+{
+	sim_sounds[sound]++;
+}
+
 static void Init()
 {
 	score_y = 0;
-	scroll_y = VIEW_HALF;
-	falling.clear();
-	landed.clear();
-	for (int i = 0; i != WELL_WIDTH; i++)
+	scroll_y = (float)view_half;
+	while (falling.size()) RemovePiece(falling.size() - 1);
+	for (std::vector<RowSummary>& summaries : row_summaries)
 	{
-		landed.push_back(Block(i, 0, 0, 0));
-		well_tops[i] = 1;
+		summaries.reserve(WELL_RESERVE_ROWS);
+		summaries.clear();
 	}
+	WELL_DISPATCH(InitWell);
 	failTicks = 0;
-	startTicks = ZLTICKS;
-	upgradeTicks = ZLTICKS;
+	startTicks = TOMTICKS;
+	upgradeTicks = TOMTICKS;
 	deadTicks = 0;
-	shake = 0;
 
-	player.x = WELL_HALF;
+	player.x = well_width / 2;
 	player.y = 1;
 	player.velx = player.vely = 0;
 	player.dead = false;
 	player.stand_landed = true;
 	player.stand_falling = false;
-	player.standTicks = ZLTICKS;
+	player.stand_piece = 0;
+	player.standTicks = TOMTICKS;
 	player.jump = 0;
 	player.jumps = 1;
+	jump_queue_count = 0;
+	rand_state = (seed ? seed : 1 + (unsigned int)((unsigned long long)(WallMs() * 1000) % 0x7FFFFFFE));
+	piece_queue_count = 0;
+	prev_step.player_x = player.x;
+	prev_step.player_y = player.y;
+	prev_step.scroll_y = scroll_y;
+
+	if (!titleScreen) Telemetry(TELEMETRY_RUN, downpour, well_width);
+	SpectatorReset();
+}
+
+//Called by the main thread, key repeats are ignored
+static void QueueInput(int key, bool down)
+{
+	int bit = 0;
+	for (int i = 0; i != COUNT_OF(input_keys); i++)
+		if (input_keys[i] == key) bit = 1 << i;
+	if (!bit || (down && (keys_down & bit))) return;
+	unsigned int head = input_head.load(std::memory_order_relaxed);
+	if (head - input_tail.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE) return;
+	keys_down = (down ? (keys_down | bit) : (keys_down & ~bit));
+	InputEvent& e = input_queue[head % INPUT_QUEUE_SIZE];
+	e.ms = WallMs();
+	e.key = bit;
+	e.down = down;
+	input_head.store(head + 1, std::memory_order_release);
+}
+
+static void TakeInput()
+{
+	unsigned int tail = input_tail.load(std::memory_order_relaxed), head = input_head.load(std::memory_order_acquire);
+	for (; tail != head && input_queue[tail % INPUT_QUEUE_SIZE].ms <= step_ms; tail++)
+	{
+		const InputEvent& e = input_queue[tail % INPUT_QUEUE_SIZE];
+		if (!e.down) { input_held &= ~e.key; continue; }
+		input_held |= e.key;
+		input_pressed |= e.key;
+		if (e.key == KEY_SPACE && jump_queue_count != JUMP_QUEUE_SIZE)
+		{
+			jump_queue[(jump_queue_start + jump_queue_count) % JUMP_QUEUE_SIZE] = e.ms;
+			jump_queue_count++;
+			input_latency = (float)(WallMs() - e.ms);
+		}
+	}
+	input_tail.store(tail, std::memory_order_release);
+}
+
+static int GameRand(int min, int max)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return min + (int)(rand_state % (unsigned int)(max - min + 1));
 }
 
-static void SpawnBlock()
+//Pieces are generated ahead one per tick, at spawn time only their placement in the well is searched
+static void GeneratePiece()
 {
-	fall_vel = 0;
+	QueuedPiece& q = piece_queue[(piece_queue_start + piece_queue_count) % PIECE_QUEUE_SIZE];
 	int level = 4 + score_y / 10;
 	int max_height = 2 * player.jumps;
-	int shape = RAND_INT_RANGE(0,3), color = RAND_INT_RANGE(1,COUNT_OF(falling_colors)-1);
-	for (int retry_shape = 0; retry_shape < 10; retry_shape++)
+	q.shape = GameRand(0,3);
+	q.color = GameRand(1,COUNT_OF(falling_colors)-1);
+	for (;;)
 	{
-		int num = RAND_INT_RANGE(1, level);
-		falling.push_back(Block(0, 0, shape, color));
+		int num = MIN(GameRand(1, level), well_width * 8);
+		q.count = 1;
+		q.x[0] = q.y[0] = 0;
 		ZL_Rect rec(0, 1, 1, 0);
 		for (int x = 0, y = 0, i = 1; i < num; i++)
 		{
-			int dir = RAND_INT_RANGE(0, 3);
+			int dir = GameRand(0, 3);
 			if (rec.Height() >= max_height && (dir == 1 || dir == 3)) { i--; continue; }
 			x += (dir == 0 ? 1 : (dir == 2 ? -1 : 0));
 			y += (dir == 1 ? 1 : (dir == 3 ? -1 : 0));
 
 			bool already_blocked = false;
-			for (Block& b : falling) { if (b.x == x && b.y == y) { already_blocked = true; break; } }
+			for (int j = 0; j != q.count; j++) { if (q.x[j] == x && q.y[j] == y) { already_blocked = true; break; } }
 			if (already_blocked) { i--; continue; }
 
-			falling.push_back(Block(x, (float)y, shape, color));
+			q.x[q.count] = (short)x;
+			q.y[q.count] = (short)y;
+			q.count++;
 
 			if (x   < rec.left  ) rec.left   = x;
 			if (x+1 > rec.right ) rec.right  = x+1;
 			if (y   < rec.bottom) rec.bottom = y;
 			if (y+1 > rec.top   ) rec.top    = y+1;
 		}
-		if ((rec.right - rec.left) > (WELL_WIDTH-4))
-		{
-			falling.clear();
-			retry_shape--;
+		if ((rec.right - rec.left) > (well_width-4))
 			continue;
-		}
-		int max_y = score_y + 1 + (2 * (player.jumps - 1)) - (rec.top - rec.bottom);
+		q.left = rec.left;
+		q.right = rec.right;
+		q.bottom = rec.bottom;
+		q.top = rec.top;
+		break;
+	}
+	piece_queue_count++;
+}
+
+//The front piece of the queue is tried first, up to ten pieces that don't fit anywhere are dropped in a tick for the next queued or generated one
+//The queue is refilled right away so the preview always shows the piece tried next
+template <int Width> static void SpawnBlock()
+{
+	for (int retry_shape = 0; retry_shape < 10; retry_shape++)
+	{
+		if (!piece_queue_count) GeneratePiece();
+		const QueuedPiece& q = piece_queue[piece_queue_start];
+
+		int max_y = score_y + 1 + (2 * (player.jumps - 1)) - (q.top - q.bottom);
 		if (max_y < 0) max_y = 0;
-		int spawn_start = -rec.left, spawn_width = WELL_WIDTH-(rec.right - rec.left)+1;
-		int rand_x = RAND_INT_RANGE(0, spawn_width - 1);
-		int spawn_x;
+		int spawn_start = -q.left, spawn_width = Width-(q.right - q.left)+1;
+		int rand_x = GameRand(0, spawn_width - 1);
+		int spawn_x, retry;
 		bool valid;
-		for (int retry = 0; retry < WELL_WIDTH; retry++)
+		for (retry = 0; retry < Width; retry++)
 		{
 			spawn_x = spawn_start + ((rand_x + retry) % spawn_width);
 			valid = true;
-			for (int i = rec.left; valid && i != rec.right; i++)
+			for (int i = q.left; valid && i != q.right; i++)
 			{
-				int setInvalid = (well_tops[spawn_x + i] > max_y);
+				int setInvalid = (Well<Width>::tops[spawn_x + i] > max_y);
 				if (setInvalid)
 				{
 					valid = false;
@@ -215,114 +828,206 @@ static void SpawnBlock()
 			}
 			if (valid) break;
 		}
+		piece_queue_start = (piece_queue_start + 1) % PIECE_QUEUE_SIZE;
+		piece_queue_count--;
 		if (!valid)
 		{
-			falling.clear();
 			continue;
 		}
-		for (Block& b : falling)
-		{
-			b.x += spawn_x;
-			b.y += scroll_y + VIEW_HALF + (rec.top - rec.bottom);
-			b.prevy = (int)b.y;
-		}
+		Piece& p = AddPiece();
+		for (int i = 0; i != q.count; i++)
+			p.blocks.push_back(Block(spawn_x + q.x[i], q.y[i] + scroll_y + view_half + (q.top - q.bottom), q.shape, q.color));
+		p.vel = p.step = 0;
+		p.low = scroll_y + view_half + q.top;
+		p.id = ++piece_counter;
 		failTicks = 0;
-		imcFall.Play(true);
+		PlaySound(SOUND_FALL);
+		Telemetry(TELEMETRY_SPAWN, retry_shape, retry);
+		SpectatorSpawn(p);
+		if (!piece_queue_count) GeneratePiece();
 		return;
 	}
+	if (!piece_queue_count) GeneratePiece();
 	if (!failTicks)
-		failTicks = ZLTICKS;
+	{
+		failTicks = TOMTICKS;
+		Telemetry(TELEMETRY_SPAWN_FAIL);
+	}
 }
 
-static void CheckCollision(bool check_y)
+//Input of unattended runs, walks back and forth and jumps when blocked or at random
+static void AutoPlay()
+{
+	static float last_x;
+	float max_x = well_width - (PLAYER_WIDTH*2);
+	if (player.x <= 0) autoplay_dir = 1;
+	else if (player.x >= max_x) autoplay_dir = -1;
+	else if (GameRand(0, 180) == 0) autoplay_dir = -autoplay_dir;
+	player.velx = (float)autoplay_dir;
+
+	bool blocked = (player.x == last_x), can_jump = (player.stand_landed || player.stand_falling || (player.jump > 0 && player.jump < player.jumps && player.vely < 0));
+	last_x = player.x;
+	if (can_jump && !jump_queue_count && (blocked || GameRand(0, 40) == 0))
+	{
+		jump_queue[jump_queue_start] = step_ms;
+		jump_queue_count = 1;
+	}
+}
+
+static void CollideBlock(float x, float y, float vely_vs_block, int piece, bool check_y, ZL_Vector& player_pos, ZL_Rectf& player_rec)
 {
-	ZL_Vector player_pos(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
-	ZL_Rectf player_rec(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
 	const float collision_check_dist = (PLAYER_HEIGHT + .5f + .2f);
 	const float collision_check_radsq = collision_check_dist*collision_check_dist*2;
-	for (int i = 0; i != 2; i++)
+	ZL_Vector block_pos(x+.5f, y+.5f);
+	if (player_pos.GetDistanceSq(block_pos) > collision_check_radsq) return;
+	ZL_Rectf block_rec(block_pos, .5f);
+	if (check_y)
 	{
-		const float vely_vs_block = (player.vely - (i ? fall_vel : 0));
-		for (Block& l : (i ? falling : landed))
+		if (vely_vs_block <= .1f && player_rec.low - .05f < block_rec.high && player_rec.high > block_rec.high && player_rec.left+.01f < block_rec.right && player_rec.right-.01f > block_rec.left)
 		{
-			ZL_Vector block_pos(l.x+.5f, l.y+.5f);
-			if (player_pos.GetDistanceSq(block_pos) > collision_check_radsq) continue;
-			ZL_Rectf block_rec(block_pos, .5f);
-			if (check_y)
-			{
-				if (vely_vs_block <= .1f && player_rec.low - .05f < block_rec.high && player_rec.high > block_rec.high && player_rec.left+.01f < block_rec.right && player_rec.right-.01f > block_rec.left)
-				{
-					player.vely = 0;
-					player.jump = 0;
-					player.y = block_rec.high;
-					(i ? player.stand_falling : player.stand_landed) = true;
-					player.standTicks = ZLTICKS;
-					player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
-					player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
-				}
-				else if (player.stand_landed && player_rec.left > block_rec.left-.1f && player_rec.right < block_rec.right+.1f && player_rec.low > block_rec.low-.1f && player_rec.high < block_rec.high+.1f)
-				{
-					player.dead = true;
-					imcDeath.Play(true);
-					deadTicks = ZLTICKS;
-				}
-				if (vely_vs_block >= -.1f && player_rec.high + .05f > block_rec.low && player_rec.low < block_rec.low && player_rec.left+.01f < block_rec.right && player_rec.right-.01f > block_rec.left)
-				{
-					if (player.vely > 0) player.vely = 0;
-					player.y = block_rec.low - (PLAYER_HEIGHT*2);
-					player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
-					player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
-				}
-			}
-			//if (check_x)
-			{
-				if (player_rec.right > block_rec.left && player_rec.left < block_rec.left && player_rec.low+.01f < block_rec.high && player_rec.high-.01f > block_rec.low)
-				{
-					player.velx = 0;
-					player.x = block_rec.left - (PLAYER_WIDTH*2);
-					player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
-					player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
-				}
-				if (player_rec.left < block_rec.right && player_rec.right > block_rec.right && player_rec.low+.01f < block_rec.high && player_rec.high-.01f > block_rec.low)
-				{
-					player.velx = 0;
-					player.x = block_rec.right;
-					player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
-					player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
-				}
-			}
+			player.vely = 0;
+			player.jump = 0;
+			player.y = block_rec.high;
+			(piece ? player.stand_falling : player.stand_landed) = true;
+			if (piece) player.stand_piece = piece;
+			player.standTicks = TOMTICKS;
+			player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
+			player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
+		}
+		else if (player.stand_landed && player_rec.left > block_rec.left-.1f && player_rec.right < block_rec.right+.1f && player_rec.low > block_rec.low-.1f && player_rec.high < block_rec.high+.1f)
+		{
+			player.dead = true;
+			PlaySound(SOUND_DEATH);
+			deadTicks = TOMTICKS;
+			Telemetry(TELEMETRY_DEATH, score_y, DEATH_CRUSHED);
+		}
+		if (vely_vs_block >= -.1f && player_rec.high + .05f > block_rec.low && player_rec.low < block_rec.low && player_rec.left+.01f < block_rec.right && player_rec.right-.01f > block_rec.left)
+		{
+			if (player.vely > 0) player.vely = 0;
+			player.y = block_rec.low - (PLAYER_HEIGHT*2);
+			player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
+			player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
+		}
+	}
+	//if (check_x)
+	{
+		if (player_rec.right > block_rec.left && player_rec.left < block_rec.left && player_rec.low+.01f < block_rec.high && player_rec.high-.01f > block_rec.low)
+		{
+			player.velx = 0;
+			player.x = block_rec.left - (PLAYER_WIDTH*2);
+			player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
+			player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
+		}
+		if (player_rec.left < block_rec.right && player_rec.right > block_rec.right && player_rec.low+.01f < block_rec.high && player_rec.high-.01f > block_rec.low)
+		{
+			player.velx = 0;
+			player.x = block_rec.right;
+			player_pos = ZL_Vector(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
+			player_rec = ZL_Rectf(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
 		}
 	}
+}
+
+//Falling pieces are checked at fraction t of their movement in the current tick
+template <int Width> static void CheckCollision(bool check_y, float t)
+{
+	const std::vector<typename Well<Width>::Row>& rows = Well<Width>::rows;
+	ZL_Vector player_pos(player.x+PLAYER_WIDTH, player.y+PLAYER_HEIGHT);
+	ZL_Rectf player_rec(player_pos, ZLV(PLAYER_WIDTH, PLAYER_HEIGHT));
+	int row_min = MAX((int)player.y - 2, 0), row_max = MIN((int)player.y + 2, (int)rows.size() - 1);
+	int col_min = MAX((int)player.x - 2, 0), col_max = MIN((int)player.x + 2, Width - 1);
+	for (int y = row_min; y <= row_max; y++)
+		for (int x = col_min; x <= col_max; x++)
+			if (rows[y].used & Well<Width>::Bit(x))
+				CollideBlock((float)x, (float)y, player.vely, 0, check_y, player_pos, player_rec);
+	for (Piece& p : falling)
+	{
+		if (p.low > player.y + 2) continue;
+		float back = p.step * (1 - t);
+		for (Block& l : p.blocks)
+			CollideBlock((float)l.x, l.y - back, player.vely - p.vel, p.id, check_y, player_pos, player_rec);
+	}
 	if (player.x < 0)
 	{
 		player.x = 0;
 	}
-	if (player.x > WELL_WIDTH - (PLAYER_WIDTH*2))
+	if (player.x > Width - (PLAYER_WIDTH*2))
+	{
+		player.x = Width - (PLAYER_WIDTH*2);
+	}
+}
+
+//Moves the player in steps no larger than the collision tolerances so no block can be passed through
+template <int Width> static void MovePlayer(float move_x, float move_y)
+{
+	float max_move = MAX(sabs(move_x), sabs(move_y));
+	for (Piece& p : falling)
+		if (p.low <= player.y + 2) max_move = MAX(max_move, sabs(p.step - move_y));
+	int steps = MAX(1, (int)sceil(max_move / PLAYER_MAX_STEP));
+	for (int i = 1; i <= steps; i++)
 	{
-		player.x = WELL_WIDTH - (PLAYER_WIDTH*2);
+		float t = (float)i / steps;
+		if (move_x)
+		{
+			player.x += move_x / steps;
+			CheckCollision<Width>(false, t);
+			if (!player.velx) move_x = 0;
+		}
+		player.y += move_y / steps;
+		player.stand_landed = player.stand_falling = false;
+		CheckCollision<Width>(true, t);
+		if (player.dead) break;
+		if (player.stand_landed || (move_y > 0 && player.vely <= 0)) move_y = 0;
+		else if (player.stand_falling)
+			for (Piece& p : falling)
+				if (p.id == player.stand_piece) move_y = p.step;
 	}
 }
 
-static void Update()
+template <int Width> static void Update()
 {
+	TakeInput();
+	if (titleScreen || player.dead || TOMSINCE(startTicks) < 500)
+		jump_queue_count = 0;
+	//Holding 'Z' zooms the view out vertically until the whole tower is visible
+	overview = ZL_Math::Clamp01(overview + TOMELAPSEDF(!titleScreen && (input_held & KEY_Z) ? 2 : -2));
+
 	if (titleScreen)
+	{
+		if (input_pressed & KEY_ESCAPE)
+		{
+			sim_quit_request = true;
+		}
+		if (input_pressed & KEY_W)
+		{
+			int i = 0;
+			while (well_widths[i] != well_width) i++;
+			SetWellWidth(well_widths[(i + 1) % COUNT_OF(well_widths)]);
+		}
+		if (input_pressed & (KEY_SPACE | KEY_X))
+		{
+			downpour = ((input_pressed & KEY_X) != 0);
+			titleScreen = false;
+			Init();
+		}
 		return;
+	}
 
-	if (ZLSINCE(startTicks) < 500)
+	if (TOMSINCE(startTicks) < 500)
 	{
 		return;
 	}
-	if (ZL_Input::Down(ZLK_ESCAPE, true))
+	if (input_pressed & KEY_ESCAPE)
 	{
-		Init();
+		if (!player.dead) Telemetry(TELEMETRY_ABANDON, score_y);
 		titleScreen = true;
-		imcMusic.SetSongVolume(40);
+		Init();
 		return;
 	}
 
 	if (player.dead)
 	{
-		if (ZLSINCE(deadTicks) > 500 && ZL_Input::Down(ZLK_SPACE, true))
+		if (TOMSINCE(deadTicks) > 500 && (autoplay || (input_pressed & KEY_SPACE)))
 		{
 			Init();
 		}
@@ -332,84 +1037,148 @@ static void Update()
 		}
 	}
 
-	player.velx = 
-		(ZL_Input::Held(ZLK_A) || ZL_Input::Held(ZLK_LEFT) ? -1.f : 0.f) +
-		(ZL_Input::Held(ZLK_D) || ZL_Input::Held(ZLK_RIGHT) ? 1.f : 0.f);
+	if (autoplay)
+	{
+		AutoPlay();
+	}
+	else
+	{
+		player.velx = 
+			(input_held & (KEY_A | KEY_LEFT) ? -1.f : 0.f) +
+			(input_held & (KEY_D | KEY_RIGHT) ? 1.f : 0.f);
+	}
+
+	while (jump_queue_count && step_ms - jump_queue[jump_queue_start] > JUMP_BUFFER_MS)
+	{
+		jump_queue_start = (jump_queue_start + 1) % JUMP_QUEUE_SIZE;
+		jump_queue_count--;
+	}
 
-	if (ZL_Input::Down(ZLK_SPACE, true) && (player.stand_landed || player.stand_falling || ZLSINCE(player.standTicks) < 120 || (player.jump > 0 && player.jump < player.jumps)))
+	//The coyote window only allows a late first take-off after walking off an edge, not another one right after jumping
+	if (jump_queue_count && (player.stand_landed || player.stand_falling || (player.jump == 0 && TOMSINCE(player.standTicks) < JUMP_COYOTE_MS) || (player.jump > 0 && player.jump < player.jumps)))
 	{
+		jump_queue_start = (jump_queue_start + 1) % JUMP_QUEUE_SIZE;
+		jump_queue_count--;
 		player.stand_landed = player.stand_falling = false;
 		player.vely = 3;
 		player.jump++;
-		imcJump.Play(true);
+		PlaySound(SOUND_JUMP);
+		Telemetry(TELEMETRY_JUMP, player.jump);
 	}
 
-	fall_vel -= TOMELAPSEDF(6);
-	float current_fall_vel = fall_vel * TOMELAPSEDF(3);
-
-	if (falling.size() == 0)
+	bool spawn = (falling.size() == 0);
+	if (downpour && falling.size() < DOWNPOUR_PIECES)
+	{
+		spawn = true;
+		for (Piece& p : falling)
+			for (Block& b : p.blocks)
+				if (b.y + 1 > scroll_y + view_half) { spawn = false; break; }
+	}
+	if (spawn)
+	{
+		SpawnBlock<Width>();
+	}
+	else if (piece_queue_count < PIECE_QUEUE_SIZE)
 	{
-		SpawnBlock();
+		GeneratePiece();
 	}
 
 #ifdef ZILLALOG
-	if (ZL_Input::Down(ZLK_L))
+	if (input_pressed & KEY_L)
 	{
 		player.y = scroll_y + 3;
-		fall_vel = -.5;
-		falling.clear();
-		for (int i = 0; i != WELL_WIDTH; i++)
-			falling.push_back(Block(i, scroll_y, 0, 0));
+		while (falling.size()) RemovePiece(falling.size() - 1);
+		AddPiece();
+		for (int i = 0; i != Width; i++)
+			falling.back().blocks.push_back(Block(i, scroll_y, 0, 0));
+		falling.back().vel = -.5;
+		falling.back().step = 0;
+		falling.back().low = scroll_y;
+		falling.back().id = ++piece_counter;
+		SpectatorSpawn(falling.back());
 	}
 #endif
 
-	int collide_height = 0;
-	for (Block& b : falling)
+	//Pieces are resolved bottom to top, each one rests on the highest falling block below it per column
+	std::sort(falling.begin(), falling.end(), [](const Piece& a, const Piece& b) { return a.low < b.low; });
+	std::vector<typename Well<Width>::Row>& rows = Well<Width>::rows;
+	float col_top[Width], col_vel[Width];
+	for (int x = 0; x != Width; x++) col_top[x] = -1;
+	float stand_vel = 0, stand_step = 0;
+	bool any_landed = false;
+	for (Piece& p : falling)
 	{
-		b.y += current_fall_vel;
-		int iy = (int)b.y;
-		if (iy < b.prevy)
+		//Positions advance by the exact distance under constant gravity so jump heights and fall speeds don't depend on TOMTICKRATE
+		//Half a 60 Hz step of extra gravity keeps the paths of the original explicit steps at 60 Hz, at 60 Hz both are identical
+		float step = (p.vel - TOMELAPSEDF(3) - TOMELAPSED60(3)) * TOMELAPSEDF(3), push = 0;
+		p.vel -= TOMELAPSEDF(6);
+		for (Block& b : p.blocks)
+		{
+			if (col_top[b.x] - (b.y + step) <= push) continue;
+			push = col_top[b.x] - (b.y + step);
+			p.vel = col_vel[b.x];
+		}
+		step += push;
+		p.step = step;
+		if (p.id == player.stand_piece) { stand_vel = p.vel; stand_step = step; }
+
+		int collide_height = 0;
+		for (Block& b : p.blocks)
 		{
-			for (int y = b.prevy - 1; y >= iy; y--)
-				for (Block& l : landed)
-					if (l.x == b.x && l.prevy == y)
-						{ 
-							collide_height = MAX(collide_height, y - iy + 1);
-							break; }
+			b.y += step;
+			int iy = (int)b.y;
+			if (iy < b.prevy)
+			{
+				for (int y = MIN(b.prevy, (int)rows.size()) - 1; y >= iy; y--)
+					if (rows[y].used & Well<Width>::Bit(b.x))
+					{
+						collide_height = MAX(collide_height, y - iy + 1);
+						break;
+					}
+			}
 			b.prevy = iy;
 		}
-	}
-	if (collide_height)
-	{
-		for (Block& b : falling)
+		if (collide_height)
 		{
-			b.y = (float)(b.prevy += collide_height);
-			well_tops[b.x] = b.prevy;
-			landed.push_back(b);
+			for (Block& b : p.blocks)
+			{
+				b.y = (float)(b.prevy += collide_height);
+				Well<Width>::tops[b.x] = b.prevy;
+				AddLandedCell<Width>(b.x, b.prevy, b.shape, b.color);
+			}
+			Telemetry(TELEMETRY_LAND, p.blocks[0].prevy, collide_height);
+			SpectatorLand(p);
+			p.blocks.clear();
+			any_landed = true;
+			continue;
+		}
+		p.low = p.blocks[0].y;
+		for (Block& b : p.blocks)
+		{
+			if (b.y < p.low) p.low = b.y;
+			if (b.y + 1 > col_top[b.x]) { col_top[b.x] = b.y + 1; col_vel[b.x] = p.vel; }
 		}
-		falling.clear();
-		imcLand.Play(true);
-		shake = .5f;
 	}
-
-	if (player.stand_falling)
+	if (any_landed)
 	{
-		player.vely = fall_vel;
-		player.y += current_fall_vel;
+		for (size_t i = falling.size(); i--;)
+			if (falling[i].blocks.empty()) RemovePiece(i);
+		PlaySound(SOUND_LAND);
+		sim_landings++;
 	}
-	if (player.velx)
+
+	float move_y = 0;
+	if (player.stand_falling)
 	{
-		player.x += player.velx * TOMELAPSEDF(6);
-		CheckCollision(false);
+		player.vely = stand_vel;
+		move_y = stand_step;
 	}
 	if (!player.stand_landed && !player.stand_falling)
 	{
+		move_y = (player.vely - TOMELAPSEDF(4) - TOMELAPSED60(4)) * TOMELAPSEDF(4);
 		player.vely -= TOMELAPSEDF(8);
-		player.y += player.vely * TOMELAPSEDF(4);
 	}
-
-	player.stand_landed = player.stand_falling = false;
-	CheckCollision(true);
+	MovePlayer<Width>(player.velx * TOMELAPSEDF(6), move_y);
 
 	if (player.y > scroll_y)
 		scroll_y = player.y;
@@ -417,53 +1186,50 @@ static void Update()
 	if (player.stand_landed && (int)player.y > score_y)
 	{
 		score_y = (int)player.y;
-		
-		txt[1] = fntMain.CreateBuffer(ZL_String(score_y));
+
 		if (score_y < 10)
 		{
-			txt[3] = fntMain.CreateBuffer("Single Jump");
-			txt[4] = fntMain.CreateBuffer("Get Double Jump at:");
-			txt[5] = fntMain.CreateBuffer("10");
+			hud_tier = 0;
 			player.jumps = 1;
 		}
 		else if (score_y >= 10 && score_y < 30)
 		{
-			txt[3] = fntMain.CreateBuffer("Double Jump");
-			txt[4] = fntMain.CreateBuffer("Get Tripple Jump at:");
-			txt[5] = fntMain.CreateBuffer("30");
+			hud_tier = 1;
 			if (player.jumps != 2)
 			{
-				imcLvlUp.Play(true);
-				upgradeTicks = ZLTICKS;
+				PlaySound(SOUND_LVLUP);
+				upgradeTicks = TOMTICKS;
 				player.jumps = 2;
+				Telemetry(TELEMETRY_LEVELUP, score_y, player.jumps);
 			}
 		}
 		else
 		{
-			txt[3] = fntMain.CreateBuffer("Tripple Jump");
-			txt[4] = fntMain.CreateBuffer("");
-			txt[5] = fntMain.CreateBuffer("");
+			hud_tier = 2;
 			if (player.jumps != 3)
 			{
-				imcLvlUp.Play(true);
-				upgradeTicks = ZLTICKS;
+				PlaySound(SOUND_LVLUP);
+				upgradeTicks = TOMTICKS;
 				player.jumps = 3;
+				Telemetry(TELEMETRY_LEVELUP, score_y, player.jumps);
 			}
 		}
 	}
 
-	if (player.y < scroll_y - VIEW_HALF - .5f)
+	if (player.y < scroll_y - view_half - .5f)
 	{
 		player.dead = true;
-		imcDeath.Play(true);
-		deadTicks = ZLTICKS;
+		PlaySound(SOUND_DEATH);
+		deadTicks = TOMTICKS;
+		Telemetry(TELEMETRY_DEATH, score_y, DEATH_FELL);
 	}
 
-	if (failTicks && ZLSINCE(failTicks) > 1000)
+	if (failTicks && TOMSINCE(failTicks) > 1000)
 	{
 		player.dead = true;
-		imcDeath.Play(true);
-		deadTicks = ZLTICKS;
+		PlaySound(SOUND_DEATH);
+		deadTicks = TOMTICKS;
+		Telemetry(TELEMETRY_DEATH, score_y, DEATH_SPAWN_TIMEOUT);
 	}
 }
 
@@ -473,50 +1239,510 @@ static void DrawTextBordered(const ZL_Vector& p, const char* txt, scalar scale =
 	fntMain.Draw(p.x  , p.y+8  , txt, scale, scale, colfill, origin);
 }
 
-static void Draw()
+//Numbers are drawn from the prebuilt digit buffers so the HUD never lays out text while playing
+static void DrawNumber(float x, float y, int value, float scale, const ZL_Color& col)
 {
-	static const ZL_Color colOutGradientTop    = ZLRGB( 0, 0,.4);
-	static const ZL_Color colOutGradientBottom = ZLRGB(.4,.4,.8);
-	static const ZL_Color colInGradientTop     = ZLRGB( 0, 0,.2);
-	static const ZL_Color colInGradientBottom  = ZLRGB(.2,.2,.4);
-	static const ZL_Color colStripes           = ZLRGB(.5,.7,.9);
-	static const ZL_Color colShadow            = ZLLUMA(0, .6);
+	int digits[10], count = 0;
+	for (unsigned int v = (unsigned int)MAX(value, 0); count == 0 || v; v /= 10) digits[count++] = v % 10;
+	while (count--)
+	{
+		txtDigits[digits[count]].Draw(x, y, scale, scale, col);
+		x += digit_width[digits[count]] * scale;
+	}
+}
 
-	ZL_Rectf view(WELL_HALF, scroll_y, ZLV(VIEW_HALF*ZLASPECTR, VIEW_HALF));
-	ZL_Display::PushOrtho(view);
+//Zoomed out the view moves from the scroll position to the middle of the tower while its span grows to the whole tower
+static void OverviewView(float overview, int well_height, int view_half, float scroll, float& view_y, float& view_span)
+{
+	view_y = scroll;
+	view_span = (float)view_half;
+	if (overview > 0)
+	{
+		float t = ZL_Easing::InQuad(overview), tower_half = MAX((float)view_half, well_height * .5f + 2);
+		view_y += (well_height * .5f - view_y) * t;
+		view_span += (tower_half - view_span) * t;
+	}
+}
 
-	if (titleScreen || ZLSINCE(startTicks) < 500)
+//Just enough of zlib inflate and PNG decoding for the 8 bit non-interlaced images in Data, used by headless frame dumps
+struct Inflate
+{
+	const unsigned char *in, *end;
+	unsigned int bits, count;
+	bool error;
+};
+
+struct InflateHuffman
+{
+	short counts[16], symbols[288];
+};
+
+static int InflateBits(Inflate& s, unsigned int need)
+{
+	while (s.count < need)
 	{
-		float t = (titleScreen ? 0 : ZL_Easing::InQuad(ZLSINCE(startTicks) / 500.f));
-		ZL_Display::Translate(view.Center());
-		ZL_Display::Scale(10.f - 9.f * t);
-		ZL_Display::Translate(-view.Center());
+		if (s.in == s.end) { s.error = true; return 0; }
+		s.bits |= (unsigned int)*s.in++ << s.count;
+		s.count += 8;
 	}
+	int val = (int)(s.bits & ((1u << need) - 1));
+	s.bits >>= need;
+	s.count -= need;
+	return val;
+}
+
+static void InflateBuild(InflateHuffman& h, const unsigned char* lengths, int n)
+{
+	short offsets[16];
+	memset(h.counts, 0, sizeof(h.counts));
+	for (int i = 0; i != n; i++) h.counts[lengths[i]]++;
+	h.counts[0] = 0;
+	offsets[1] = 0;
+	for (int len = 1; len != 15; len++) offsets[len + 1] = offsets[len] + h.counts[len];
+	for (int i = 0; i != n; i++)
+		if (lengths[i]) h.symbols[offsets[lengths[i]]++] = (short)i;
+}
 
-	if (shake > .1f)
+//Canonical codes are read bit by bit, first is the first code of the current length and index its first symbol
+static int InflateDecode(Inflate& s, const InflateHuffman& h)
+{
+	for (int len = 1, code = 0, first = 0, index = 0; len != 16 && !s.error; len++)
 	{
-		shake *= .9f;
-		ZL_Display::Translate(RAND_ANGLEVEC*shake);
+		code |= InflateBits(s, 1);
+		if (code - h.counts[len] < first) return h.symbols[index + code - first];
+		index += h.counts[len];
+		first = (first + h.counts[len]) << 1;
+		code <<= 1;
 	}
+	s.error = true;
+	return 0;
+}
 
-	ZL_Display::ClearFill(colOutGradientTop);
-	ZL_Display::FillRect(0, view.low - 1, WELL_WIDTH, view.high + 1, colInGradientTop);
-	ZL_Display::FillGradient(0, -1, WELL_WIDTH, 100, colInGradientTop, colInGradientTop, colInGradientBottom, colInGradientBottom);
-	srfBG.DrawTo(0.f, (float)(int)view.low-1, (float)WELL_WIDTH, view.high+1, ZLRGBA(.1,.1,.25,.5));
+static bool InflateZlib(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+	static const short length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const unsigned char length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const short dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static const unsigned char dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	if (size < 2 || (data[0] & 15) != 8) return false;
+	Inflate s = { data + 2, data + size, 0, 0, false };
+	InflateHuffman lencode, distcode;
+	unsigned char lengths[288 + 32];
+	for (int last = 0; !last && !s.error;)
+	{
+		last = InflateBits(s, 1);
+		int type = InflateBits(s, 2);
+		if (type == 0)
+		{
+			s.bits = s.count = 0;
+			if (s.end - s.in < 4) return false;
+			int len = s.in[0] | (s.in[1] << 8);
+			s.in += 4;
+			if (s.end - s.in < len) return false;
+			out.insert(out.end(), s.in, s.in + len);
+			s.in += len;
+			continue;
+		}
+		if (type == 1)
+		{
+			for (int i = 0; i != 288; i++) lengths[i] = (i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8)));
+			for (int i = 0; i != 30; i++) lengths[288 + i] = 5;
+			InflateBuild(lencode, lengths, 288);
+			InflateBuild(distcode, lengths + 288, 30);
+		}
+		else if (type == 2)
+		{
+			int nlen = InflateBits(s, 5) + 257, ndist = InflateBits(s, 5) + 1, ncode = InflateBits(s, 4) + 4;
+			memset(lengths, 0, 19);
+			for (int i = 0; i != ncode; i++) lengths[order[i]] = (unsigned char)InflateBits(s, 3);
+			InflateBuild(lencode, lengths, 19);
+			for (int i = 0; i < nlen + ndist && !s.error;)
+			{
+				int sym = InflateDecode(s, lencode);
+				if (sym < 16) { lengths[i++] = (unsigned char)sym; continue; }
+				int repeat = (sym == 16 ? 3 + InflateBits(s, 2) : (sym == 17 ? 3 + InflateBits(s, 3) : 11 + InflateBits(s, 7)));
+				if ((sym == 16 && !i) || i + repeat > nlen + ndist) return false;
+				unsigned char len = (sym == 16 ? lengths[i - 1] : 0);
+				while (repeat--) lengths[i++] = len;
+			}
+			InflateBuild(lencode, lengths, nlen);
+			InflateBuild(distcode, lengths + nlen, ndist);
+		}
+		else return false;
 
-	if (titleScreen)
+		for (;;)
+		{
+			int sym = InflateDecode(s, lencode);
+			if (s.error || sym == 256) break;
+			if (sym < 256) { out.push_back((unsigned char)sym); continue; }
+			if ((sym -= 257) >= 29) return false;
+			int len = length_base[sym] + InflateBits(s, length_extra[sym]), dsym = InflateDecode(s, distcode);
+			if (dsym >= 30) return false;
+			size_t dist = (size_t)(dist_base[dsym] + InflateBits(s, dist_extra[dsym]));
+			if (dist > out.size()) return false;
+			while (len--) out.push_back(out[out.size() - dist]);
+		}
+	}
+	return !s.error;
+}
+
+//Draw renders through these Canvas functions, on the GPU while playing or, for headless frame dumps, on the CPU into framedump_image
+//The CPU side covers what Draw uses during play with the same images the surfaces load, sampled at the nearest texel
+struct CanvasImage
+{
+	int width, height, tile_width, tile_height;
+	float repeat; //world units per repetition of textures in repeat mode, 0 to stretch over the rectangle
+	std::vector<unsigned char> rgba;
+};
+static bool headless;
+static ZL_Rectf canvas_view;
+static CanvasImage imgBG, imgBlocks, imgPlayer, imgStripes;
+
+static bool CanvasLoad(CanvasImage& img, const char* path, int tiles_x, int tiles_y, float repeat)
+{
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+	static const int type_channels[7] = { 1, 0, 3, 0, 2, 0, 4 };
+	FILE* f = fopen(path, "rb");
+	if (!f) return false;
+	fseek(f, 0, SEEK_END);
+	std::vector<unsigned char> file((size_t)MAX(ftell(f), 0L)), data, raw;
+	fseek(f, 0, SEEK_SET);
+	bool read = (fread(file.data(), 1, file.size(), f) == file.size());
+	fclose(f);
+	if (!read || file.size() < 8 || memcmp(file.data(), signature, 8)) return false;
+
+	int width = 0, height = 0, channels = 0;
+	for (size_t pos = 8; pos + 12 <= file.size();)
 	{
-		if (ZL_Input::Down(ZLK_ESCAPE, true))
+		const unsigned char* chunk = &file[pos];
+		size_t len = ((size_t)chunk[0] << 24) | (chunk[1] << 16) | (chunk[2] << 8) | chunk[3];
+		if (len > file.size() - pos - 12) return false;
+		if (!memcmp(chunk + 4, "IHDR", 4) && len >= 13)
 		{
-			ZL_Application::Quit();
+			const unsigned char* h = chunk + 8;
+			width = (h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+			height = (h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+			channels = (h[8] == 8 && h[9] <= 6 && !h[10] && !h[11] && !h[12] ? type_channels[h[9]] : 0);
 		}
-		if (ZL_Input::Down(ZLK_SPACE, true))
+		else if (!memcmp(chunk + 4, "IDAT", 4)) data.insert(data.end(), chunk + 8, chunk + 8 + len);
+		pos += 12 + len;
+	}
+	if (!channels || width <= 0 || height <= 0 || data.empty() || !InflateZlib(data.data(), data.size(), raw)) return false;
+	const size_t stride = (size_t)width * channels;
+	if (raw.size() < (stride + 1) * height) return false;
+
+	//Each row starts with its filter type, the filters predict from the left (a), upper (b) and upper left (c) bytes
+	for (int y = 0; y != height; y++)
+	{
+		unsigned char* row = &raw[y * (stride + 1) + 1], *prior = (y ? row - stride - 1 : NULL);
+		const int filter = row[-1];
+		for (size_t i = 0; i != stride; i++)
 		{
-			titleScreen = false;
-			imcMusic.SetSongVolume(20);
-			Init();
+			int a = (i >= (size_t)channels ? row[i - channels] : 0), b = (prior ? prior[i] : 0), c = (prior && i >= (size_t)channels ? prior[i - channels] : 0);
+			int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+			int predict = (filter == 1 ? a : (filter == 2 ? b : (filter == 3 ? (a + b) / 2 : (filter == 4 ? (pa <= pb && pa <= pc ? a : (pb <= pc ? b : c)) : 0))));
+			row[i] = (unsigned char)(row[i] + predict);
+		}
+	}
+
+	img.width = width;
+	img.height = height;
+	img.tile_width = width / tiles_x;
+	img.tile_height = height / tiles_y;
+	img.repeat = repeat;
+	img.rgba.resize((size_t)width * height * 4);
+	for (int y = 0; y != height; y++)
+		for (int x = 0; x != width; x++)
+		{
+			const unsigned char* src = &raw[y * (stride + 1) + 1 + x * channels];
+			unsigned char* dst = &img.rgba[((size_t)y * width + x) * 4];
+			dst[0] = src[0];
+			dst[1] = src[channels >= 3 ? 1 : 0];
+			dst[2] = src[channels >= 3 ? 2 : 0];
+			dst[3] = (channels == 2 || channels == 4 ? src[channels - 1] : 255);
 		}
+	return true;
+}
+
+static void CanvasPushOrtho(const ZL_Rectf& view)
+{
+	if (!headless) { ZL_Display::PushOrtho(view); return; }
+	canvas_view = view;
+}
+
+static void CanvasPopOrtho()
+{
+	if (!headless) { ZL_Display::PopOrtho(); return; }
+	canvas_view = ZL_Rectf(0, 0, ZLWIDTH, ZLHEIGHT);
+}
+
+//Scales the view up around center
+static void CanvasZoom(const ZL_Vector& center, float scale)
+{
+	if (!headless)
+	{
+		ZL_Display::Translate(center);
+		ZL_Display::Scale(scale);
+		ZL_Display::Translate(-center);
+		return;
+	}
+	canvas_view = ZL_Rectf(center.x + (canvas_view.left - center.x) / scale, center.y + (canvas_view.low - center.y) / scale, center.x + (canvas_view.right - center.x) / scale, center.y + (canvas_view.high - center.y) / scale);
+}
+
+static ZL_Vector CanvasWorldToScreen(float x, float y)
+{
+	if (!headless) return ZL_Display::WorldToScreen(x, y);
+	return ZLV((x - canvas_view.left) * ZLWIDTH / canvas_view.Width(), (y - canvas_view.low) * ZLHEIGHT / canvas_view.Height());
+}
+
+//Pixels covered by a rectangle are the ones with their centers inside of it, like with the GL rasterizer
+static bool CanvasSpan(float x1, float y1, float x2, float y2, int& left, int& low, int& right, int& high)
+{
+	float sx = FRAMEDUMP_WIDTH / canvas_view.Width(), sy = FRAMEDUMP_HEIGHT / canvas_view.Height();
+	left = (int)sceil(MAX((MIN(x1, x2) - canvas_view.left) * sx - .5f, 0.f));
+	right = (int)sceil(MIN((MAX(x1, x2) - canvas_view.left) * sx - .5f, (float)FRAMEDUMP_WIDTH));
+	low = (int)sceil(MAX((MIN(y1, y2) - canvas_view.low) * sy - .5f, 0.f));
+	high = (int)sceil(MIN((MAX(y1, y2) - canvas_view.low) * sy - .5f, (float)FRAMEDUMP_HEIGHT));
+	return (left < right && low < high);
+}
+
+static unsigned char* CanvasPixel(int x, int y)
+{
+	return &framedump_image[((FRAMEDUMP_HEIGHT - 1 - y) * FRAMEDUMP_WIDTH + x) * 3];
+}
+
+//Channels are clamped like GL does with vertex colors, the brightened falling colors go past 1
+static ZL_Color CanvasColor(const ZL_Color& col)
+{
+	return ZLRGBA(ZL_Math::Clamp01(col.r), ZL_Math::Clamp01(col.g), ZL_Math::Clamp01(col.b), ZL_Math::Clamp01(col.a));
+}
+
+static ZL_Color CanvasMix(const ZL_Color& a, const ZL_Color& b, float t)
+{
+	return ZLRGBA(a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t, a.a + (b.a - a.a) * t);
+}
+
+static void CanvasBlend(unsigned char* p, float r, float g, float b, float a)
+{
+	p[0] = (unsigned char)(p[0] + (r - p[0]) * a + .5f);
+	p[1] = (unsigned char)(p[1] + (g - p[1]) * a + .5f);
+	p[2] = (unsigned char)(p[2] + (b - p[2]) * a + .5f);
+}
+
+static void CanvasClear(const ZL_Color& col)
+{
+	if (!headless) { ZL_Display::ClearFill(col); return; }
+	ZL_Color c = CanvasColor(col);
+	for (int i = 0; i != FRAMEDUMP_SIZE; i += 3)
+	{
+		framedump_image[i] = (unsigned char)(c.r * 255 + .5f);
+		framedump_image[i+1] = (unsigned char)(c.g * 255 + .5f);
+		framedump_image[i+2] = (unsigned char)(c.b * 255 + .5f);
+	}
+}
+
+//The top colors are the ones at y2
+static void CanvasFillGradient(float x1, float y1, float x2, float y2, const ZL_Color& top_left, const ZL_Color& top_right, const ZL_Color& bottom_left, const ZL_Color& bottom_right)
+{
+	if (!headless) { ZL_Display::FillGradient(x1, y1, x2, y2, top_left, top_right, bottom_left, bottom_right); return; }
+	int left, low, right, high;
+	if (!CanvasSpan(x1, y1, x2, y2, left, low, right, high)) return;
+	float sx = FRAMEDUMP_WIDTH / canvas_view.Width(), sy = FRAMEDUMP_HEIGHT / canvas_view.Height();
+	for (int y = low; y < high; y++)
+	{
+		float ty = ZL_Math::Clamp01((canvas_view.low + (y + .5f) / sy - y1) / (y2 - y1));
+		ZL_Color l = CanvasColor(CanvasMix(bottom_left, top_left, ty)), r = CanvasColor(CanvasMix(bottom_right, top_right, ty));
+		unsigned char* p = CanvasPixel(left, y);
+		for (int x = left; x < right; x++, p += 3)
+		{
+			ZL_Color c = CanvasMix(l, r, ZL_Math::Clamp01((canvas_view.left + (x + .5f) / sx - x1) / (x2 - x1)));
+			CanvasBlend(p, c.r * 255, c.g * 255, c.b * 255, c.a);
+		}
+	}
+}
+
+static void CanvasFillRect(float x1, float y1, float x2, float y2, const ZL_Color& col)
+{
+	if (!headless) { ZL_Display::FillRect(x1, y1, x2, y2, col); return; }
+	CanvasFillGradient(x1, y1, x2, y2, col, col, col, col);
+}
+
+//Draws tile (or the whole surface if negative) upright into the rectangle, mirrored if x2 is left of x1
+static void CanvasDrawTo(ZL_Surface& srf, const CanvasImage& img, int tile, float x1, float y1, float x2, float y2, const ZL_Color& col)
+{
+	if (!headless)
+	{
+		if (tile >= 0) srf.SetTilesetIndex(tile);
+		srf.DrawTo(x1, y1, x2, y2, col);
+		return;
+	}
+	int left, low, right, high;
+	if (!CanvasSpan(x1, y1, x2, y2, left, low, right, high)) return;
+	float sx = FRAMEDUMP_WIDTH / canvas_view.Width(), sy = FRAMEDUMP_HEIGHT / canvas_view.Height();
+	int tiles_x = img.width / img.tile_width, tile_x = MAX(tile, 0) % tiles_x * img.tile_width, tile_y = MAX(tile, 0) / tiles_x * img.tile_height;
+	static int columns[FRAMEDUMP_WIDTH];
+	for (int x = left; x < right; x++)
+	{
+		float u = (canvas_view.left + (x + .5f) / sx - x1) / (img.repeat ? img.repeat : x2 - x1);
+		if (img.repeat) u -= sfloor(u);
+		columns[x] = tile_x + MIN(MAX((int)(u * img.tile_width), 0), img.tile_width - 1);
+	}
+	ZL_Color c = CanvasColor(col);
+	for (int y = low; y < high; y++)
+	{
+		float v = (canvas_view.low + (y + .5f) / sy - y1) / (img.repeat ? img.repeat : y2 - y1);
+		if (img.repeat) v -= sfloor(v);
+		const unsigned char* texels = &img.rgba[(size_t)(tile_y + MIN(MAX((int)((1 - v) * img.tile_height), 0), img.tile_height - 1)) * img.width * 4];
+		unsigned char* p = CanvasPixel(left, y);
+		for (int x = left; x < right; x++, p += 3)
+		{
+			const unsigned char* t = &texels[columns[x] * 4];
+			CanvasBlend(p, t[0] * c.r, t[1] * c.g, t[2] * c.b, t[3] * c.a / 255.f);
+		}
+	}
+}
+
+static void CanvasBatchBegin(ZL_Surface& srf)
+{
+	if (!headless) srf.BatchRenderBegin(true);
+}
+
+static void CanvasBatchEnd(ZL_Surface& srf)
+{
+	if (!headless) srf.BatchRenderEnd();
+}
+
+static const char tilemap_vertex_shader[] =
+	ZL_SHADER_SOURCE_HEADER(ZL_GLES_PRECISION_HIGH)
+	"uniform mat4 u_mvpMatrix;"
+	"uniform float u_base;"
+	"attribute vec4 a_position;"
+	"varying vec2 v_cell;"
+	"void main()"
+	"{"
+		"v_cell = vec2(a_position.x, a_position.y - u_base);"
+		"gl_Position = u_mvpMatrix * a_position;"
+	"}";
+
+//Cells are encoded as red = shape, green = color, blue = occupied, rows outside of u_low to u_high were not written for this frame
+//The probe texel tells if the render target stores its first row at the bottom or the top of the texture
+static const char tilemap_fragment_shader[] =
+	ZL_SHADER_SOURCE_HEADER(ZL_GLES_PRECISION_HIGH)
+	"uniform sampler2D u_texture;"
+	"uniform float u_low, u_high, u_shadow_y;"
+	"varying vec2 v_cell;"
+	"float bottom_up;"
+	"vec4 Texel(vec2 p)"
+	"{"
+		"p = p / vec2(256.0, 1024.0);"
+		"return texture2D(u_texture, vec2(p.x, bottom_up > 0.5 ? p.y : 1.0 - p.y));"
+	"}"
+	"vec4 Cell(vec2 c)"
+	"{"
+		"if (c.x < 0.0 || c.y < u_low || c.y >= u_high) return vec4(0.0);"
+		"return Texel(vec2(128.5 + c.x, mod(c.y, 1024.0) + 0.5));"
+	"}"
+	"void main()"
+	"{"
+		"bottom_up = texture2D(u_texture, vec2(255.5 / 256.0, 0.5 / 1024.0)).r;"
+		"vec2 s = v_cell - vec2(0.2, u_shadow_y);"
+		"float shadow_a = Cell(floor(s)).b * 0.6;"
+		"vec4 cell = Cell(floor(v_cell));"
+		"float shape = floor(cell.r * 4.0);"
+		"vec2 tile = vec2(mod(shape, 2.0), floor(shape / 2.0)) * 64.0 + clamp(fract(v_cell) * 64.0, 0.5, 63.5);"
+		"vec4 col = Texel(tile) * Texel(vec2(floor(cell.g * 8.0) + 0.5, 128.5));"
+		"float a = cell.b * col.a, out_a = a + shadow_a * (1.0 - a);"
+		"gl_FragColor = vec4(out_a > 0.0 ? col.rgb * a / out_a : vec3(0.0), out_a);"
+	"}";
+
+static void TilemapInit()
+{
+	srfTilemap = ZL_Surface(TILEMAP_WIDTH, TILEMAP_RING, true);
+	srfTilemap.RenderToBegin(true);
+	ZL_Display::PushOrtho(ZL_Rectf(0, 0, TILEMAP_WIDTH, TILEMAP_RING));
+	for (int i = 0; i != 4; i++)
+		srfBlocks.SetTilesetIndex(i).DrawTo((float)(i % 2 * TILEMAP_TILE), (float)(i / 2 * TILEMAP_TILE), (float)(i % 2 * TILEMAP_TILE + TILEMAP_TILE), (float)(i / 2 * TILEMAP_TILE + TILEMAP_TILE));
+	for (int i = 0; i != COUNT_OF(landed_colors); i++)
+		ZL_Display::FillRect((float)i, (float)TILEMAP_TILE * 2, (float)i + 1, (float)TILEMAP_TILE * 2 + 1, landed_colors[i]);
+	ZL_Display::FillRect(TILEMAP_WIDTH - 1, 0, TILEMAP_WIDTH, 1, ZLWHITE);
+	ZL_Display::PopOrtho();
+	srfTilemap.RenderToEnd();
+	shdTilemap = ZL_Shader(tilemap_fragment_shader, tilemap_vertex_shader, "u_base", "u_low", "u_high", "u_shadow_y");
+	for (int& row : tilemap_rows) row = -1;
+}
+
+static void TilemapUpdate(const Snapshot& snap, int row_min, int row_max)
+{
+	bool rendering = false;
+	for (int y = row_min; y <= row_max; y++)
+	{
+		const SnapshotRow& row = snap.rows[y - snap.row_first];
+		int slot = y % TILEMAP_RING;
+		if (tilemap_rows[slot] == y && tilemap_serials[slot] == row.serial) continue;
+		if (!rendering)
+		{
+			srfTilemap.RenderToBegin();
+			ZL_Display::PushOrtho(ZL_Rectf(0, 0, TILEMAP_WIDTH, TILEMAP_RING));
+			rendering = true;
+		}
+		tilemap_rows[slot] = y;
+		tilemap_serials[slot] = row.serial;
+		ZL_Display::FillRect(TILEMAP_RING_X, (float)slot, TILEMAP_RING_X + WELL_MAX_WIDTH, (float)slot + 1, ZLBLACK);
+		for (int x = 0; x != snap.width; x++)
+			if (row.used & (1ull << x))
+				ZL_Display::FillRect((float)(TILEMAP_RING_X + x), (float)slot, (float)(TILEMAP_RING_X + x + 1), (float)slot + 1, ZLRGB((row.shape[x] * 64 + 32) / 255.f, (row.color[x] * 32 + 16) / 255.f, 1));
+	}
+	if (rendering)
+	{
 		ZL_Display::PopOrtho();
+		srfTilemap.RenderToEnd();
+	}
+}
+
+static void Draw(const Snapshot& snap, float step_alpha)
+{
+	const int Width = snap.width;
+	const float lerp_back = 1.f - step_alpha;
+	const float draw_scroll_y = snap.scroll_y - (snap.scroll_y - snap.prev.scroll_y) * lerp_back;
+	float view_y, view_span;
+	OverviewView(snap.overview, snap.well_height, snap.view_half, draw_scroll_y, view_y, view_span);
+	ZL_Rectf view(Width * .5f, view_y, ZLV(snap.view_half*ZLASPECTR, view_span));
+	int row_min = MAX((int)sceil(view.low) - 2, snap.row_first), row_max = MIN((int)view.high + 1, snap.row_first + (int)snap.rows.size() - 1);
+	const bool tilemap = (!headless && !snap.title && row_max - row_min < TILEMAP_RING);
+	if (tilemap) TilemapUpdate(snap, row_min, row_max);
+	CanvasPushOrtho(view);
+
+	if (snap.title || snap.since_start < 500)
+	{
+		float t = (snap.title ? 0 : ZL_Easing::InQuad(snap.since_start / 500.f));
+		CanvasZoom(view.Center(), 10.f - 9.f * t);
+	}
+
+	static unsigned int shake_landings;
+	if (snap.landings != shake_landings)
+	{
+		shake_landings = snap.landings;
+		shake = .5f;
+	}
+	if (shake > .1f && !headless) //the direction is random, frame dumps leave the shake out to stay comparable
+	{
+		shake *= .9f;
+		ZL_Display::Translate(RAND_ANGLEVEC*shake);
+	}
+
+	//The gradients cover -1 to 100, the flat fill of the well is limited to the areas above and below them
+	const bool showGradients = (view.low - 1 < 100);
+	CanvasClear(colOutGradientTop);
+	if (view.high + 1 > 100) CanvasFillRect(0, MAX(view.low - 1, 100.f), (float)Width, view.high + 1, colInGradientTop);
+	if (view.low - 1 < -1) CanvasFillRect(0, view.low - 1, (float)Width, -1, colInGradientTop);
+	if (showGradients) CanvasFillGradient(0, -1, (float)Width, 100, colInGradientTop, colInGradientTop, colInGradientBottom, colInGradientBottom);
+	CanvasDrawTo(srfBG, imgBG, -1, 0.f, (float)(int)view.low-1, (float)Width, view.high+1, ZLRGBA(.1,.1,.25,.5));
+
+	//The title screen is never rendered headless
+	if (snap.title)
+	{
+		CanvasPopOrtho();
 
 		ZL_Vector titlePos = ZLV(ZLHALFW, ZLHALFH+130);
 		ZL_Color colOuter = ZLLUMA(0, .1), colInner = ZLHSVA(smod(ZLTICKS*.001f,1.f),1,1, .2);
@@ -530,8 +1756,11 @@ static void Draw()
 		ZL_Color ColText = ZLRGBA(.6,.8,1,.75), ColBorder = ZLLUMA(0,.5);
 		DrawTextBordered(ZLV(ZLHALFW,210), "Climb the Tower of Minos without getting crushed!", 1.f, ColText, ColBorder);
 		DrawTextBordered(ZLV(ZLHALFW,150), "'A' Move left        'D' Move right        'SPACE' Jump", 1.f, ColText, ColBorder);
-		DrawTextBordered(ZLV(ZLHALFW,100), "PRESS 'SPACE' TO BEGIN", 0.8f, ColText, ColBorder);
-		DrawTextBordered(ZLV(ZLHALFW, 50), "'ALT-ENTER' Toggle Fullscreen", 0.5f, ColText, ColBorder);
+		DrawTextBordered(ZLV(ZLHALFW,100), "PRESS 'SPACE' TO BEGIN - 'X' FOR DOWNPOUR MODE", 0.8f, ColText, ColBorder);
+		char width_text[32];
+		snprintf(width_text, sizeof(width_text), "'W' Well Width: %d", Width);
+		DrawTextBordered(ZLV(ZLHALFW, 72), width_text, 0.6f, ColText, ColBorder);
+		DrawTextBordered(ZLV(ZLHALFW, 50), "'ALT-ENTER' Toggle Fullscreen        'Z' Tower Overview", 0.5f, ColText, ColBorder);
 		DrawTextBordered(ZLV(18, 12), "2019 - Bernhard Schelling", s(.6), ZLRGBA(.5,.7,.8,.5), ColBorder, 2, ZL_Origin::BottomLeft);
 
 		srfLudumDare.Draw(ZLFROMW(10), 10);
@@ -539,107 +1768,449 @@ static void Draw()
 		return;
 	}
 
-	srfBlocks.BatchRenderBegin(true);
-	float shadowx = .2f, shadowy = .2f - (MIN(scroll_y, 100.f) / 333.f);
-	for (Block& b : landed)
+	for (const SnapshotRect& r : snap.lod_rects)
+		CanvasFillRect(0, r.low, (float)Width, r.high, r.color);
+
+	CanvasBatchBegin(srfBlocks);
+	float shadowx = .2f, shadowy = .2f - (MIN(draw_scroll_y, 100.f) / 333.f);
+	for (int y = row_min; !tilemap && y <= row_max; y++)
 	{
-		if (b.y - 1 > view.high || b.y + 2 < view.low) continue;
-		srfBlocks.DrawTo((float)b.x+shadowx, (float)b.y+shadowy, (float)b.x+1+shadowx, (float)b.y+1+shadowy, colShadow);
+		for (int x = 0; x != Width; x++)
+		{
+			if (!(snap.rows[y - snap.row_first].used & (1ull << x))) continue;
+			CanvasDrawTo(srfBlocks, imgBlocks, -1, (float)x+shadowx, (float)y+shadowy, (float)x+1+shadowx, (float)y+1+shadowy, colShadow);
+		}
 	}
-	for (Block& b : falling)
+	for (const SnapshotBlock& b : snap.blocks)
 	{
-		if (b.y - 1 > view.high || b.y + 2 < view.low) continue;
-		srfBlocks.DrawTo((float)b.x+shadowx, (float)b.y+shadowy, (float)b.x+1+shadowx, (float)b.y+1+shadowy, colShadow);
+		float by = b.y - b.step * lerp_back;
+		if (by - 1 > view.high || by + 2 < view.low) continue;
+		CanvasDrawTo(srfBlocks, imgBlocks, -1, b.x+shadowx, by+shadowy, b.x+1+shadowx, by+1+shadowy, colShadow);
 	}
 
-	for (Block& b : landed)
+	if (tilemap && row_min <= row_max)
 	{
-		if (b.y - 1 > view.high || b.y + 2 < view.low) continue;
-		//ZL_Display::FillRect(b.x, b.y, b.x+1, b.y+1, ZL_Color::Yellow);
-		srfBlocks.SetTilesetIndex(b.shape).DrawTo((float)b.x, (float)b.y, (float)b.x+1, (float)b.y+1, landed_colors[b.color]);
+		CanvasBatchEnd(srfBlocks);
+		float base = (float)(row_min / TILEMAP_RING * TILEMAP_RING);
+		shdTilemap.Activate();
+		shdTilemap.SetUniform(base, row_min - base, row_max + 1 - base, shadowy);
+		srfTilemap.DrawTo(0.f, (float)row_min - 1, (float)Width, (float)row_max + 2);
+		shdTilemap.Deactivate();
+		CanvasBatchBegin(srfBlocks);
+	}
+	for (int y = row_min; !tilemap && y <= row_max; y++)
+	{
+		const SnapshotRow& row = snap.rows[y - snap.row_first];
+		for (int x = 0; x != Width; x++)
+		{
+			if (!(row.used & (1ull << x))) continue;
+			//ZL_Display::FillRect(x, y, x+1, y+1, ZL_Color::Yellow);
+			CanvasDrawTo(srfBlocks, imgBlocks, row.shape[x], (float)x, (float)y, (float)x+1, (float)y+1, landed_colors[row.color[x]]);
+		}
 	}
-	for (Block& b : falling)
+	for (const SnapshotBlock& b : snap.blocks)
 	{
-		if (b.y - 1 > view.high || b.y + 2 < view.low) continue;
-		//ZL_Display::FillRect(b.x, b.y, b.x+1, b.y+1, ZL_Color::Red);
-		srfBlocks.SetTilesetIndex(b.shape).DrawTo((float)b.x, (float)b.y, (float)b.x+1, (float)b.y+1, falling_colors[b.color]);
+		float by = b.y - b.step * lerp_back;
+		if (by - 1 > view.high || by + 2 < view.low) continue;
+		//ZL_Display::FillRect(b.x, by, b.x+1, by+1, ZL_Color::Red);
+		CanvasDrawTo(srfBlocks, imgBlocks, b.shape, b.x, by, b.x+1, by+1, falling_colors[b.color]);
 	}
-	srfBlocks.BatchRenderEnd();
+	CanvasBatchEnd(srfBlocks);
 
+	const Player& player = snap.player;
 	if (!player.dead)
 	{
 		//ZL_Display::FillRect(player.x, player.y, player.x+PLAYER_WIDTH*2, player.y+PLAYER_HEIGHT*2, ZL_Color::Pink);
 		//ZL_Display::DrawCircle(player.x+.4f, player.y+.4f, .4f, ZL_Color::Black);
-		srfPlayer.SetTilesetIndex(player.vely ? 1 : (player.velx ? 3 + ((ZLTICKS / 80) % 3) : 0));
-		if (player.velx > 0) srfPlayer.SetScale( PLAYER_SCALE, PLAYER_SCALE);
-		if (player.velx < 0) srfPlayer.SetScale(-PLAYER_SCALE, PLAYER_SCALE);
-		srfPlayer.Draw(player.x+PLAYER_WIDTH, player.y);
+		static float player_scale = PLAYER_SCALE;
+		if (player.velx) player_scale = (player.velx > 0 ? PLAYER_SCALE : -PLAYER_SCALE);
+		int frame = (player.vely ? 1 : (player.velx ? 3 + ((snap.since_start / 80) % 3) : 0));
+		float px = player.x - (player.x - snap.prev.player_x) * lerp_back + PLAYER_WIDTH, py = player.y - (player.y - snap.prev.player_y) * lerp_back;
+		if (headless) CanvasDrawTo(srfPlayer, imgPlayer, frame, px - imgPlayer.tile_width * player_scale * .5f, py, px + imgPlayer.tile_width * player_scale * .5f, py + imgPlayer.tile_height * PLAYER_SCALE, ZLWHITE);
+		else srfPlayer.SetTilesetIndex(frame).SetScale(player_scale, PLAYER_SCALE).Draw(px, py);
 	}
 
 	static float stretchT = 0;
-	stretchT += ZLELAPSEDTICKS * (.001f + MIN(score_y, 100) * .0002f);
+	if (!headless) stretchT += ZLELAPSEDTICKS * (.001f + MIN(snap.score, 100) * .0002f);
 	float stretchStripes = ssin(stretchT);
-	ZL_Display::FillGradient(view.left - 1, -1, 0, 100, colOutGradientTop, colOutGradientTop, colOutGradientBottom, colOutGradientBottom);
-	ZL_Display::FillGradient((float)WELL_WIDTH, -1, view.right + 1, 100, colOutGradientTop, colOutGradientTop, colOutGradientBottom, colOutGradientBottom);
-	srfStripes.DrawTo(view.left - 2 + stretchStripes, view.low - 1, (float)0, view.high + 1, colStripes);
-	srfStripes.DrawTo(view.right + 2 - stretchStripes, view.low - 1, (float)WELL_WIDTH, view.high + 1, colStripes);
+	if (showGradients)
+	{
+		CanvasFillGradient(view.left - 1, -1, 0, 100, colOutGradientTop, colOutGradientTop, colOutGradientBottom, colOutGradientBottom);
+		CanvasFillGradient((float)Width, -1, view.right + 1, 100, colOutGradientTop, colOutGradientTop, colOutGradientBottom, colOutGradientBottom);
+	}
+	CanvasDrawTo(srfStripes, imgStripes, -1, view.left - 2 + stretchStripes, view.low - 1, (float)0, view.high + 1, colStripes);
+	CanvasDrawTo(srfStripes, imgStripes, -1, view.right + 2 - stretchStripes, view.low - 1, (float)Width, view.high + 1, colStripes);
 
-	float text_x = ZL_Display::WorldToScreen(WELL_WIDTH, 0).x;
-	ZL_Display::PopOrtho();
+	float text_x = CanvasWorldToScreen((float)Width, 0).x;
+	CanvasPopOrtho();
+
+	if (snap.has_next)
+	{
+		const QueuedPiece& q = snap.next;
+		CanvasBatchBegin(srfBlocks);
+		for (float shadow = 3.f; shadow >= 0; shadow -= 3.f)
+		{
+			for (int i = 0; i != q.count; i++)
+			{
+				float x = text_x + 50 + (q.x[i] - q.left) * PREVIEW_CELL + shadow, y = ZLFROMH(420) - (q.top - q.y[i]) * PREVIEW_CELL - shadow;
+				CanvasDrawTo(srfBlocks, imgBlocks, q.shape, x, y, x + PREVIEW_CELL, y + PREVIEW_CELL, (shadow ? colShadow : falling_colors[q.color]));
+			}
+		}
+		CanvasBatchEnd(srfBlocks);
+	}
+
+	//Text is only drawn by the GPU
+	if (headless) return;
 
 	for (float shadow = 3.f; shadow >= 0; shadow -= 3.f)
 	{
 		ZL_Color col = (shadow ? ZLLUMA(0,.6) : ZLWHITE);
 		txt[0].Draw(text_x + 50 + shadow, ZLFROMH(100) - shadow, col);
-		txt[1].Draw(text_x + 50 + shadow, ZLFROMH(130) - shadow, col);
+		DrawNumber(text_x + 50 + shadow, ZLFROMH(130) - shadow, snap.score, 1, col);
 		txt[2].Draw(text_x + 50 + shadow, ZLFROMH(200) - shadow, col);
-		txt[3].Draw(text_x + 50 + shadow, ZLFROMH(230) - shadow, col);
-		txt[4].Draw(text_x + 50 + shadow, ZLFROMH(300) - shadow, col);
-		txt[5].Draw(text_x + 50 + shadow, ZLFROMH(330) - shadow, col);
-		fntMain.Draw(MAX(text_x + 10, ZLFROMW(200)) + shadow, 10 - shadow, "Press 'ESC' to restart", .5f, .5f, col);
+		if (snap.hud_tier >= 0)
+		{
+			txtJumps[snap.hud_tier].Draw(text_x + 50 + shadow, ZLFROMH(230) - shadow, col);
+			txtJumpsNext[snap.hud_tier].Draw(text_x + 50 + shadow, ZLFROMH(300) - shadow, col);
+			txtJumpsAt[snap.hud_tier].Draw(text_x + 50 + shadow, ZLFROMH(330) - shadow, col);
+		}
+		if (snap.has_next) txtNext.Draw(text_x + 50 + shadow, ZLFROMH(400) - shadow, col);
+		txtRestartEsc.Draw(MAX(text_x + 10, ZLFROMW(200)) + shadow, 10 - shadow, .5f, .5f, col);
 	}
 
-	if (ZLSINCE(upgradeTicks) < 500)
+#ifdef ZILLALOG
+	int debug_values[3] = { (int)(snap.input_latency * 1000), (int)snap.spectator_bytes, (int)(snap.spectator_bytes * 1000ull / MAX(snap.since_start, (ticks_t)1)) };
+	for (int i = 0; i != (spectator_path ? 3 : 1); i++)
 	{
-		float t = ZL_Easing::InQuad(ZLSINCE(upgradeTicks) / 500.f);
+		txtDebug[i].Draw(10, 10 + i * 15.f, .5f, .5f, ZLWHITE);
+		DrawNumber(10 + debug_width[i], 10 + i * 15.f, debug_values[i], .5f, ZLWHITE);
+	}
+#endif
+
+	if (snap.since_upgrade < 500 && snap.hud_tier >= 0)
+	{
+		float t = ZL_Easing::InQuad(snap.since_upgrade / 500.f);
 		for (float shadow = 3.f; shadow >= 0; shadow -= 3.f)
 		{
 			ZL_Color col = (shadow ? ZLLUMA(0,.3) : ZLLUMA(1, .5));
-			txt[3].Draw(text_x + 50 + shadow, ZLFROMH(230) - shadow - 10 + 10*t, 2 - t, 2 - t, col);
+			txtJumps[snap.hud_tier].Draw(text_x + 50 + shadow, ZLFROMH(230) - shadow - 10 + 10*t, 2 - t, 2 - t, col);
 		}
 	}
 
 	if (player.dead)
 	{
 		ZL_Color colOuter = ZLLUMA(0, .1), colInner = ZLLUMA(1, .2);
-		float t = ZL_Easing::InQuad(1.f - ZL_Math::Clamp01(ZLSINCE(deadTicks) / 1000.f));
+		float t = ZL_Easing::InQuad(1.f - ZL_Math::Clamp01(snap.since_dead / 1000.f));
 		for (float scale = 10; scale >= 0; scale--)
 			for (int i = 0; i != 9; i++)
 				txtGameOver.Draw(ZLCENTER+ZLV(i/3-1,(i%3)-1)*3, 2+scale*t, 2+scale*t, colOuter, ZL_Origin::Center);
 		for (float scale = 10; scale >= 0; scale--)
 			txtGameOver.Draw(ZLCENTER, 2+scale*t, 2+scale*t, colInner, ZL_Origin::Center);
-		if (ZLSINCE(deadTicks) > 500)
+		if (snap.since_dead > 500)
+		{
+			txtRestartSpace.Draw(ZLCENTER - ZLV(0, 100), 1, 1, ZLWHITE, ZL_Origin::Center);
+		}
+	}
+}
+
+#ifdef TOM_ALLOC_CHECK
+#include <assert.h>
+//Debug build hook counting all heap allocations done through new, on glibc also malloc, calloc and realloc calls made by the framework, separately for each thread
+static thread_local int alloc_count;
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void* malloc(size_t size) noexcept { alloc_count++; return __libc_malloc(size); }
+extern "C" void* calloc(size_t count, size_t size) noexcept { alloc_count++; return __libc_calloc(count, size); }
+extern "C" void* realloc(void* p, size_t size) noexcept { alloc_count++; return __libc_realloc(p, size); }
+#endif
+void* operator new(size_t size) { alloc_count++; return malloc(size ? size : 1); }
+void* operator new[](size_t size) { alloc_count++; return malloc(size ? size : 1); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+#endif
+
+static void FrameDumpEnd()
+{
+	if (framecompare) printf("Compared %u frames, %u differ\n", framedump_index, framedump_failures);
+	framedump = NULL;
+}
+
+static void FrameDumpOutput()
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s%06u.ppm", framedump, framedump_index);
+	if (framecompare)
+	{
+		FILE* f = fopen(path, "rb");
+		if (!f) { FrameDumpEnd(); return; }
+		int w = 0, h = 0, max = 0, differ = 0;
+		bool valid = (fscanf(f, "P6 %d %d %d", &w, &h, &max) == 3 && fgetc(f) != EOF && w == FRAMEDUMP_WIDTH && h == FRAMEDUMP_HEIGHT && max == 255 && fread(framedump_golden, 1, FRAMEDUMP_SIZE, f) == FRAMEDUMP_SIZE);
+		fclose(f);
+		for (int i = 0; valid && i != FRAMEDUMP_SIZE; i += 3)
+			if (abs(framedump_golden[i] - framedump_image[i]) > FRAMEDUMP_TOLERANCE || abs(framedump_golden[i+1] - framedump_image[i+1]) > FRAMEDUMP_TOLERANCE || abs(framedump_golden[i+2] - framedump_image[i+2]) > FRAMEDUMP_TOLERANCE)
+				differ++;
+		if (!valid) fprintf(stderr, "%s: image size does not match\n", path);
+		else if (differ) fprintf(stderr, "%s: %d pixels differ\n", path, differ);
+		if (!valid || differ) framedump_failures++;
+	}
+	else
+	{
+		FILE* f = fopen(path, "wb");
+		if (!f) return;
+		fprintf(f, "P6\n%d %d\n255\n", FRAMEDUMP_WIDTH, FRAMEDUMP_HEIGHT);
+		fwrite(framedump_image, 1, FRAMEDUMP_SIZE, f);
+		fclose(f);
+	}
+	if (++framedump_index == framedump_frames) FrameDumpEnd();
+}
+
+template <int Width> static void SimPublish(double ms)
+{
+	const std::vector<typename Well<Width>::Row>& rows = Well<Width>::rows;
+	Snapshot& snap = snapshots[snapshot_write];
+	snap.ms = ms;
+	snap.title = titleScreen;
+	snap.quit = sim_quit_request;
+	snap.width = Width;
+	snap.view_half = view_half;
+	snap.well_height = well_height;
+	snap.score = score_y;
+	snap.hud_tier = hud_tier;
+	snap.player = player;
+	snap.prev = prev_step;
+	snap.scroll_y = scroll_y;
+	snap.overview = overview;
+	snap.since_start = TOMSINCE(startTicks);
+	snap.since_upgrade = TOMSINCE(upgradeTicks);
+	snap.since_dead = TOMSINCE(deadTicks);
+	snap.landings = sim_landings;
+	memcpy(snap.sounds, sim_sounds, sizeof(snap.sounds));
+	snap.input_latency = input_latency;
+	snap.spectator_bytes = spectator_bytes;
+
+	//Landed rows are taken for the views at both scroll positions Draw interpolates between, plus the rows it draws beyond the view
+	float view_y, prev_view_y, view_span;
+	OverviewView(overview, well_height, view_half, prev_step.scroll_y, prev_view_y, view_span);
+	OverviewView(overview, well_height, view_half, scroll_y, view_y, view_span);
+	float view_low = MIN(view_y, prev_view_y) - view_span, view_high = MAX(view_y, prev_view_y) + view_span;
+	snap.rows.clear();
+	snap.lod_rects.clear();
+	snap.row_first = 0;
+	snap.lod = (view_span * 2 * LOD_ROW_PIXELS > display_height.load());
+	if (snap.lod)
+	{
+		//Merge as many rows as fall onto one screen pixel into a single rectangle, rounded down to whole chunks of the coarsest level that fits
+		int stride = MAX(1, (int)(view_span * 2 / display_height.load())), level = 0;
+		while (level != LOD_LEVELS - 1 && (stride >> (LOD_LEVEL_SHIFT * (level + 1)))) level++;
+		const int shift = LOD_LEVEL_SHIFT * level;
+		const std::vector<RowSummary>& summaries = row_summaries[level];
+		stride = stride >> shift << shift;
+		int summary_min = MAX((int)view_low / stride * stride, 0), summary_max = MIN((int)view_high + 1, (int)row_summaries[0].size() - 1);
+		for (int r = summary_min; r <= summary_max; r += stride)
+		{
+			RowSummary sum = RowSummary();
+			for (int i = r >> shift, end = MIN((r + stride) >> shift, (int)summaries.size()); i < end; i++)
+			{
+				sum.cells += summaries[i].cells;
+				sum.r += summaries[i].r;
+				sum.g += summaries[i].g;
+				sum.b += summaries[i].b;
+			}
+			if (!sum.cells) continue;
+			float fill = (float)sum.cells / (stride * Width);
+			SnapshotRect rect = { (float)r, (float)(r + stride), ZLRGBA(sum.r / sum.cells, sum.g / sum.cells, sum.b / sum.cells, fill) };
+			snap.lod_rects.push_back(rect);
+		}
+	}
+	else
+	{
+		snap.row_first = MAX((int)sfloor(view_low) - 3, 0);
+		for (int y = snap.row_first, y_max = MIN((int)view_high + 2, (int)rows.size() - 1); y <= y_max; y++)
+		{
+			snap.rows.resize(snap.rows.size() + 1);
+			SnapshotRow& row = snap.rows.back();
+			row.used = (unsigned long long)rows[y].used;
+			memcpy(row.shape, rows[y].shape, Width);
+			memcpy(row.color, rows[y].color, Width);
+			row.serial = rows[y].serial;
+		}
+	}
+
+	snap.blocks.clear();
+	for (const Piece& p : falling)
+		for (const Block& b : p.blocks)
+		{
+			SnapshotBlock block = { (float)b.x, b.y, p.step, b.shape, b.color };
+			snap.blocks.push_back(block);
+		}
+	snap.has_next = (piece_queue_count != 0);
+	if (snap.has_next) snap.next = piece_queue[piece_queue_start];
+
+	snapshot_write = snapshot_ready.exchange(snapshot_write | SNAPSHOT_FRESH) & 3;
+}
+
+static const Snapshot& SnapshotTake()
+{
+	if (snapshot_ready.load() & SNAPSHOT_FRESH) snapshot_read = snapshot_ready.exchange(snapshot_read) & 3;
+	return snapshots[snapshot_read];
+}
+
+static void SimStep(double ms)
+{
+	WELL_DISPATCH(WellReserve);
+	if (spectator >= 0 && spectator_buf.capacity() < spectator_buf.size() + SPECTATOR_RESERVE_AHEAD) spectator_buf.reserve(spectator_buf.size() + SPECTATOR_RESERVE_AHEAD);
+#ifdef TOM_ALLOC_CHECK
+	int allocs = alloc_count;
+#endif
+	sim_steps++;
+	step_ms = ms;
+	prev_step.player_x = player.x;
+	prev_step.player_y = player.y;
+	prev_step.scroll_y = scroll_y;
+	for (Piece& p : falling) p.step = 0;
+	WELL_DISPATCH(Update);
+	input_pressed = 0;
+	SpectatorTick();
+#ifdef TOM_ALLOC_CHECK
+	assert(titleScreen || player.dead || TOMSINCE(startTicks) < 2000 || alloc_count == allocs);
+#endif
+}
+
+//Runs the steps standing for the wall clock times up to ms, then writes the spectator stream and publishes the state
+static void SimAdvance(int steps, double ms)
+{
+	for (int step = 0; step != steps; step++)
+		SimStep(ms - (steps - 1 - step) * 1000.0 / TOMTICKRATE);
+	SpectatorFlush();
+	WELL_DISPATCH(SimPublish, ms);
+}
+
+#ifndef __EMSCRIPTEN__
+//Steps run at their scheduled wall clock times independent of the frame rate, after falling behind by more than SIM_MAX_BEHIND_MS the schedule restarts from now
+static void SimThread()
+{
+	const double tick_ms = 1000.0 / TOMTICKRATE;
+	double next_ms = WallMs();
+	while (!sim_quit.load())
+	{
+		double now = WallMs();
+		if (now < next_ms)
 		{
-			fntMain.Draw(ZLCENTER - ZLV(0, 100), "Press 'SPACE' to restart", ZLWHITE, ZL_Origin::Center);
+			std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(next_ms - now));
+			continue;
 		}
+		if (now - next_ms > SIM_MAX_BEHIND_MS) next_ms = now;
+		int steps = 1 + (int)((now - next_ms) / tick_ms);
+		next_ms += (steps - 1) * tick_ms;
+		SimAdvance(steps, next_ms);
+		next_ms += tick_ms;
 	}
 }
 
+static void SimQuit()
+{
+	sim_quit = true;
+	sim_thread.join();
+}
+#endif
+
+//Frame dumps need no window, the steps run back to back and Draw renders every FRAMEDUMP_INTERVAL steps of play on the CPU
+//The images are read straight from the Data directory, so dumps are run from the game directory rather than with a release data bundle
+static void FrameDumpRun()
+{
+	headless = true;
+	autoplay = true;
+	if (!seed) seed = 1;
+	ZL_Display::Width = FRAMEDUMP_WIDTH; //Draw lays out the view and the HUD for the screen size
+	ZL_Display::Height = FRAMEDUMP_HEIGHT;
+	display_height = FRAMEDUMP_HEIGHT;
+	if (!CanvasLoad(imgBG, "Data/bg.png", 1, 1, 1.f) || !CanvasLoad(imgBlocks, "Data/blocks.png", 2, 2, 0) || !CanvasLoad(imgPlayer, "Data/player.png", 3, 2, 0) || !CanvasLoad(imgStripes, "Data/stripes.png", 1, 1, 0))
+	{
+		fprintf(stderr, "Could not load the images in Data\n");
+		exit(1);
+	}
+
+	titleScreen = false;
+	Init();
+	for (double ms = 0; framedump; ms += 1000.0 / TOMTICKRATE)
+	{
+		SimStep(ms);
+		if (titleScreen || player.dead || ++framedump_ticks % FRAMEDUMP_INTERVAL) continue;
+		SpectatorFlush();
+		WELL_DISPATCH(SimPublish, ms);
+		Draw(SnapshotTake(), 1.f);
+		FrameDumpOutput();
+	}
+	SpectatorFlush();
+	exit(framedump_failures || !framedump_index ? 1 : 0);
+}
+
 static struct sTowerOfMinos : public ZL_Application
 {
 	sTowerOfMinos() : ZL_Application(60) { }
 
 	virtual void Load(int argc, char *argv[])
 	{
+		int start_width = 0;
+		for (int i = 1; i < argc - 1; i++)
+		{
+			if (!strcmp(argv[i], "-spectate"))
+				spectator_path = argv[++i];
+#ifndef __EMSCRIPTEN__
+			else if (!strcmp(argv[i], "-telemetry"))
+			{
+				static char telemetry_filebuf[BUFSIZ];
+				telemetry = fopen(argv[++i], "wb");
+				if (!telemetry) continue;
+				setvbuf(telemetry, telemetry_filebuf, _IOFBF, sizeof(telemetry_filebuf));
+				telemetry_thread = std::thread(TelemetryThread);
+				atexit(TelemetryQuit);
+			}
+#endif
+			else if (!strcmp(argv[i], "-framedump"))
+				framedump = argv[++i];
+			else if (!strcmp(argv[i], "-framecompare"))
+			{
+				framedump = argv[++i];
+				framecompare = true;
+			}
+			else if (!strcmp(argv[i], "-frames"))
+				framedump_frames = (unsigned int)atoi(argv[++i]);
+			else if (!strcmp(argv[i], "-seed"))
+				seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+			else if (!strcmp(argv[i], "-width"))
+				start_width = atoi(argv[++i]);
+		}
+#ifdef SIGPIPE
+		if (spectator_path) signal(SIGPIPE, SIG_IGN);
+#endif
+
+		SetWellWidth(well_widths[0]);
+		for (int width : well_widths)
+			if (width == start_width) SetWellWidth(width);
+		falling.reserve(DOWNPOUR_PIECES + 1);
+		block_pool.reserve(DOWNPOUR_PIECES + 1);
+		for (Snapshot& snap : snapshots)
+		{
+			snap.rows.reserve(SNAPSHOT_RESERVE_ROWS);
+			snap.lod_rects.reserve(SNAPSHOT_RESERVE_ROWS);
+			snap.blocks.reserve((DOWNPOUR_PIECES + 1) * PIECE_MAX_BLOCKS);
+		}
+		if (framedump) FrameDumpRun();
+
 		if (!ZL_Application::LoadReleaseDesktopDataBundle()) return;
 		if (!ZL_Display::Init("Tower of Minos", 1280, 720, ZL_DISPLAY_ALLOWRESIZEHORIZONTAL)) return;
 		ZL_Display::ClearFill(ZL_Color::White);
 		ZL_Display::SetAA(true);
 		ZL_Audio::Init();
 		ZL_Input::Init();
+		ZL_Display::sigKeyDown.connect(this, &sTowerOfMinos::OnKeyDown);
+		ZL_Display::sigKeyUp.connect(this, &sTowerOfMinos::OnKeyUp);
 
 		fntMain = ZL_Font("Data/vipond_chubby.ttf.zip", 32);
-		srfBG = ZL_Surface("Data/bg.png").SetTextureRepeatMode().SetScale(WELL_WIDTH/64.f/WELL_WIDTH);
+		srfBG = ZL_Surface("Data/bg.png").SetTextureRepeatMode().SetScale(1/64.f);
 		srfBlocks = ZL_Surface("Data/blocks.png").SetTilesetClipping(2, 2);
 		srfPlayer = ZL_Surface("Data/player.png").SetTilesetClipping(3, 2).SetOrigin(ZL_Origin::BottomCenter).SetScale(PLAYER_SCALE, PLAYER_SCALE);
 		srfStripes = ZL_Surface("Data/stripes.png");
@@ -649,16 +2220,93 @@ static struct sTowerOfMinos : public ZL_Application
 		txtTitle = fntMain.CreateBuffer(.5f, "Tower\nof\nMinos");
 		txt[0] = fntMain.CreateBuffer("Score:");
 		txt[2] = fntMain.CreateBuffer("Current:");
+		txtJumps[0] = fntMain.CreateBuffer("Single Jump");
+		txtJumps[1] = fntMain.CreateBuffer("Double Jump");
+		txtJumps[2] = fntMain.CreateBuffer("Tripple Jump");
+		txtJumpsNext[0] = fntMain.CreateBuffer("Get Double Jump at:");
+		txtJumpsNext[1] = fntMain.CreateBuffer("Get Tripple Jump at:");
+		txtJumpsNext[2] = fntMain.CreateBuffer("");
+		txtJumpsAt[0] = fntMain.CreateBuffer("10");
+		txtJumpsAt[1] = fntMain.CreateBuffer("30");
+		txtJumpsAt[2] = fntMain.CreateBuffer("");
+		txtRestartEsc = fntMain.CreateBuffer("Press 'ESC' to restart");
+		txtRestartSpace = fntMain.CreateBuffer("Press 'SPACE' to restart");
+		txtNext = fntMain.CreateBuffer("Next:");
+		for (int i = 0; i != 10; i++)
+		{
+			char digit[2] = { (char)('0' + i), 0 };
+			txtDigits[i] = fntMain.CreateBuffer(digit);
+			digit_width[i] = fntMain.GetDimensions(digit).x;
+		}
+#ifdef ZILLALOG
+		const char* debug_labels[3] = { "Input latency us: ", "Spectator bytes: ", "Spectator bytes/s: " };
+		for (int i = 0; i != 3; i++)
+		{
+			txtDebug[i] = fntMain.CreateBuffer(debug_labels[i]);
+			debug_width[i] = fntMain.GetDimensions(debug_labels[i]).x * .5f;
+		}
+#endif
+		TilemapInit();
 
 		imcMusic.Play();
+		display_height = (int)ZLHEIGHT;
+		WELL_DISPATCH(SimPublish, WallMs());
+#ifndef __EMSCRIPTEN__
+		sim_thread = std::thread(SimThread);
+		atexit(SimQuit);
+#endif
+	}
+
+	void OnKeyDown(ZL_KeyboardEvent& e)
+	{
+		QueueInput(e.key, true);
+	}
+
+	void OnKeyUp(ZL_KeyboardEvent& e)
+	{
+		QueueInput(e.key, false);
 	}
 
 	virtual void AfterFrame()
 	{
-		static float accumulate = 0;
-		for (accumulate += ZLELAPSED; accumulate > TOMTPF; accumulate -= TOMTPF)
-			Update();
-		Draw();
+		display_height = (int)ZLHEIGHT;
+		double frame_ms = WallMs();
+#ifndef __EMSCRIPTEN__
+		if (!sim_thread.joinable())
+#endif
+		{
+			static float accumulate = 0;
+			int steps = 0;
+			for (accumulate += ZLELAPSED; accumulate > TOMTPF; accumulate -= TOMTPF) steps++;
+			//The last step stands for now less the time already accumulated towards the next one
+			if (steps) SimAdvance(steps, frame_ms - accumulate * 1000.0);
+		}
+
+		const Snapshot& snap = SnapshotTake();
+		static ZL_SynthImcTrack* const sound_tracks[SOUND_COUNT] = { &imcJump, &imcDeath, &imcFall, &imcLand, &imcLvlUp };
+		static unsigned int sounds_played[SOUND_COUNT];
+		for (int i = 0; i != SOUND_COUNT; i++)
+			if (snap.sounds[i] != sounds_played[i]) { sounds_played[i] = snap.sounds[i]; sound_tracks[i]->Play(true); }
+		static bool music_title = snap.title;
+		if (snap.title != music_title)
+		{
+			music_title = snap.title;
+			imcMusic.SetSongVolume(music_title ? 40 : 20);
+		}
+		static bool quitting;
+		if (snap.quit && !quitting)
+		{
+			quitting = true;
+			ZL_Application::Quit();
+		}
+
+#ifdef TOM_ALLOC_CHECK
+		int allocs = alloc_count;
+#endif
+		Draw(snap, ZL_Math::Clamp01((float)(frame_ms - snap.ms) * TOMTICKRATE / 1000.f));
+#ifdef TOM_ALLOC_CHECK
+		assert(snap.title || snap.player.dead || snap.since_start < 2000 || alloc_count == allocs);
+#endif
 	}
 } TowerOfMinos;
 
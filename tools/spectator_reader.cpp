@@ -0,0 +1,164 @@
+/*
+  Tower of Minos - Spectator stream reader
+  Copyright (C) 2019 Bernhard Schelling
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+//Parses the delta stream written by the game with '-spectate <fifo or file>' and checks the bytes of each tick against the bound documented there
+//Build with 'c++ -O2 -o spectator_reader tools/spectator_reader.cpp', run with 'spectator_reader [-v] <fifo or file>' or read from stdin
+//With -v every tick is printed with its size, player position and score, otherwise only the summary
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#define SPECTATOR_TICKRATE 60
+
+enum
+{
+	SPECTATE_TICK   = 1,
+	SPECTATE_RESET  = 2,
+	SPECTATE_PLAYER = 3,
+	SPECTATE_SPAWN  = 4,
+	SPECTATE_FALL   = 5,
+	SPECTATE_LAND   = 6,
+	SPECTATE_SCORE  = 7,
+	SPECTATE_DEAD   = 8,
+};
+
+static FILE* in;
+static unsigned long long offset;
+static bool truncated;
+
+static int Get(int bytes, bool is_signed = false)
+{
+	unsigned int v = 0;
+	for (int i = 0; i != bytes; i++)
+	{
+		int c = fgetc(in);
+		if (c == EOF) { truncated = true; return 0; }
+		v |= (unsigned int)c << (i * 8);
+	}
+	offset += bytes;
+	if (is_signed && bytes < 4 && (v & (1u << (bytes * 8 - 1)))) v |= ~0u << (bytes * 8);
+	return (int)v;
+}
+
+int main(int argc, char *argv[])
+{
+	bool verbose = false;
+	const char* path = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-v")) verbose = true;
+		else path = argv[i];
+	}
+	in = (path ? fopen(path, "rb") : stdin);
+	if (!in) { fprintf(stderr, "Could not open %s\n", path); return 1; }
+
+	std::vector<int> falling; //ids of the pieces that spawned and did not land yet
+	unsigned long long ticks = 0, tick_start = 0, total = 0;
+	unsigned int tick_count = 0, max_bytes = 0, over_bound = 0, resets = 0, bound = 0;
+	int width = 0, x = 0, y = 0, score = 0, errors = 0;
+	bool in_tick = false, dead = false;
+	for (;;)
+	{
+		unsigned long long record_start = offset;
+		int tag = fgetc(in);
+		if (tag != EOF) offset++;
+		if ((tag == EOF || tag == SPECTATE_TICK) && in_tick)
+		{
+			//Fixed cost of a tick is 24 bytes (tick 3, reset 10, player 5, score 5, dead 1), each piece in the well adds up to 7 (fall 5 or land 7)
+			unsigned int bytes = (unsigned int)(record_start - tick_start);
+			bound += 24;
+			if (bytes > bound) over_bound++;
+			if (bytes > max_bytes) max_bytes = bytes;
+			total += bytes;
+			tick_count++;
+			if (verbose) printf("tick %llu: %u bytes (bound %u), player %.2f %.2f, score %d%s\n", ticks, bytes, bound, x / 256.0, y / 256.0, score, (dead ? ", dead" : ""));
+			in_tick = false;
+		}
+		if (tag == EOF) break;
+		if (!in_tick && tag != SPECTATE_TICK) { fprintf(stderr, "Record %d at offset %llu is outside of a tick\n", tag, record_start); errors++; break; }
+		switch (tag)
+		{
+			case SPECTATE_TICK:
+				ticks += Get(2);
+				tick_start = record_start;
+				bound = 7 * (unsigned int)falling.size();
+				in_tick = true;
+				break;
+			case SPECTATE_RESET:
+				width = Get(1);
+				x = Get(4);
+				y = Get(4);
+				falling.clear();
+				dead = false;
+				resets++;
+				break;
+			case SPECTATE_PLAYER:
+				x += Get(2, true);
+				y += Get(2, true);
+				break;
+			case SPECTATE_SPAWN:
+			{
+				int id = Get(2), count = Get(2);
+				Get(4);
+				for (int i = 0; i != count; i++)
+				{
+					int bx = Get(1);
+					Get(1);
+					Get(1);
+					if (bx >= width) { fprintf(stderr, "Block of piece %d at offset %llu is outside of the well\n", id, record_start); errors++; }
+				}
+				falling.push_back(id);
+				bound += 9 + 3 * count + 7;
+				break;
+			}
+			case SPECTATE_FALL:
+			case SPECTATE_LAND:
+			{
+				int id = Get(2);
+				Get(tag == SPECTATE_FALL ? 2 : 4);
+				std::vector<int>::iterator it = std::find(falling.begin(), falling.end(), id);
+				if (it == falling.end()) { fprintf(stderr, "Unknown piece %d at offset %llu\n", id, record_start); errors++; }
+				else if (tag == SPECTATE_LAND) falling.erase(it);
+				break;
+			}
+			case SPECTATE_SCORE:
+				score = Get(4);
+				break;
+			case SPECTATE_DEAD:
+				dead = true;
+				break;
+			default:
+				fprintf(stderr, "Unknown record %d at offset %llu\n", tag, record_start);
+				errors++;
+				break;
+		}
+		if (truncated || errors) break;
+	}
+	if (path) fclose(in);
+
+	if (truncated) { fprintf(stderr, "Stream ends inside a record at offset %llu\n", offset); errors++; }
+	printf("%llu bytes, %u ticks with records over %llu ticks, %u runs\n", offset, tick_count, ticks, resets);
+	printf("Bytes per tick: max %u, average %.2f, %.0f bytes/s at %d Hz\n", max_bytes, (ticks ? (double)total / ticks : 0), (ticks ? (double)total * SPECTATOR_TICKRATE / ticks : 0), SPECTATOR_TICKRATE);
+	printf("Ticks over the bound: %u\n", over_bound);
+	return (errors || over_bound ? 1 : 0);
+}